@@ -25,6 +25,7 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/err.h>
 #include <linux/hdreg.h>
 #include <linux/kdev_t.h>
 #include <linux/blkdev.h>
@@ -35,6 +36,7 @@
 #include <linux/capability.h>
 #include <linux/compat.h>
 #include <linux/pm_runtime.h>
+#include <linux/math64.h>
 
 #include <linux/mmc/ioctl.h>
 #include <linux/mmc/card.h>
@@ -44,10 +46,9 @@
 
 #include <asm/uaccess.h>
 
-#include "queue.h"
-#if defined(CONFIG_FMBT_TRACE_EMMC)
 #include <linux/mmc/mem_log.h>
-#endif
+
+#include "queue.h"
 
 
 
@@ -66,24 +67,26 @@ MODULE_ALIAS("mmc:block");
 #define MMC_BLK_TIMEOUT_MS  (30 * 1000)        /* 30 sec timeout */
 
 #define MMC_SANITIZE_REQ_TIMEOUT 240000 /* msec */
+#define MMC_BLK_PART_SLICE_MS	20	/* host time of a partition */
+#define MMC_BLK_PART_HANDOFF_MS	100	/* max wait after yielding */
+#define MMC_BLK_RPMB_POLL_MS	25	/* card busy after an RPMB write */
 
 #define mmc_req_rel_wr(req)	(((req->cmd_flags & REQ_FUA) || \
 			(req->cmd_flags & REQ_META)) && \
 			(rq_data_dir(req) == WRITE))
 #define PACKED_CMD_VER		0x01
+#define PACKED_CMD_RD		0x01
 #define PACKED_CMD_WR		0x02
-#define PACKED_TRIGGER_MAX_ELEMENTS	5000
 #define MMC_BLK_UPDATE_STOP_REASON(stats, reason)			\
 	do {								\
-		if (stats->enabled)					\
+		if (stats && stats->enabled)				\
 			stats->pack_stop_reason[reason]++;		\
 	} while (0)
 
-#define PCKD_TRGR_INIT_MEAN_POTEN	17
 #define PCKD_TRGR_POTEN_LOWER_BOUND	5
 #define PCKD_TRGR_URGENT_PENALTY	2
 #define PCKD_TRGR_LOWER_BOUND		5
-#define PCKD_TRGR_PRECISION_MULTIPLIER	100
+#define PCKD_TRGR_EWMA_WEIGHT		3	/* new samples weigh 1/8 */
 
 static DEFINE_MUTEX(block_mutex);
 
@@ -132,11 +135,31 @@ struct mmc_blk_data {
 	 * track of the current selected device partition.
 	 */
 	unsigned int	part_curr;
+	/*
+	 * Partition dispatcher state, also only in the main mmc_blk_data:
+	 * partitions waiting to claim the host (bit per part_type), when
+	 * the current burst got it and what switching costs.
+	 */
+	unsigned long	part_waiting;
+	unsigned long	part_slice_start;
+	unsigned int	part_slice_ms;
+	unsigned long	part_switches;
+	unsigned long	part_yields;
+	u64		part_switch_ns;
+	bool		part_yielded;	/* per partition: gave the host away */
 	struct device_attribute force_ro;
 	struct device_attribute power_ro_lock;
 	struct device_attribute num_wr_reqs_to_start_packing;
 	struct device_attribute bkops_check_threshold;
 	struct device_attribute no_pack_for_random;
+	struct device_attribute queue_depth;
+	struct device_attribute packed_limit;
+	struct device_attribute packed_trigger;
+	struct device_attribute urgent_budget_us;
+	struct device_attribute urgent_max_intr;
+	struct device_attribute urgent_stats;
+	struct device_attribute part_slice;
+	struct device_attribute part_switch_stats;
 	int	area_type;
 };
 
@@ -316,6 +339,27 @@ num_wr_reqs_to_start_packing_show(struct device *dev,
 	return ret;
 }
 
+static ssize_t
+packed_trigger_show(struct device *dev,
+		    struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_queue *mq = &md->queue;
+	int burst = mq->wr_burst_avg;
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE,
+		       "trigger %d burst_avg %d.%02d read_intr %d%%\n",
+		       mq->num_wr_reqs_to_start_packing,
+		       burst >> MMC_PACK_EWMA_SHIFT,
+		       ((burst & ((1 << MMC_PACK_EWMA_SHIFT) - 1)) * 100) >>
+		       MMC_PACK_EWMA_SHIFT,
+		       (mq->rd_intr_avg * 100) >> MMC_PACK_EWMA_SHIFT);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
 static ssize_t
 num_wr_reqs_to_start_packing_store(struct device *dev,
 				 struct device_attribute *attr,
@@ -460,6 +504,273 @@ exit:
 	return ret;
 }
 
+static ssize_t
+queue_depth_show(struct device *dev,
+		 struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "%d\n", md->queue.qdepth);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+queue_depth_store(struct device *dev,
+		  struct device_attribute *attr,
+		  const char *buf, size_t count)
+{
+	int value;
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	int ret = count;
+
+	if (!card || sscanf(buf, "%d", &value) != 1) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	ret = mmc_queue_set_depth(&md->queue, value);
+	if (ret) {
+		pr_err("%s: queue depth %d not set (%d), old value remains = %d",
+			mmc_hostname(card->host), value, ret,
+			md->queue.qdepth);
+		goto exit;
+	}
+	ret = count;
+
+	pr_debug("%s: queue_depth: new value = %d",
+		mmc_hostname(card->host), md->queue.qdepth);
+
+exit:
+	mmc_blk_put(md);
+	return ret;
+}
+
+/*
+ * Requests per packed command: what the card advertises, capped by the
+ * packed_limit sysfs override or else by a vendor quirk.
+ */
+static u8 mmc_blk_packed_limit(struct mmc_queue *mq, u8 max_packed)
+{
+	unsigned int limit = mq->packed_limit;
+
+	if (!limit)
+		limit = mq->card->packed_limit;
+	if (limit && limit < max_packed)
+		return limit;
+	return max_packed;
+}
+
+static ssize_t
+packed_limit_show(struct device *dev,
+		  struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "%d\n", card ?
+		mmc_blk_packed_limit(&md->queue,
+				     card->ext_csd.max_packed_writes) : 0);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+packed_limit_store(struct device *dev,
+		   struct device_attribute *attr,
+		   const char *buf, size_t count)
+{
+	int value;
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	int ret = count;
+
+	if (!card || sscanf(buf, "%d", &value) != 1) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	/* 0 goes back to the card default */
+	if (value < 0 || value > 0xff) {
+		pr_err("%s: value %d is not valid. old value remains = %d",
+			mmc_hostname(card->host), value,
+			md->queue.packed_limit);
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	md->queue.packed_limit = value;
+
+	pr_debug("%s: packed_limit: new value = %d",
+		mmc_hostname(card->host), md->queue.packed_limit);
+
+exit:
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+urgent_budget_us_show(struct device *dev,
+		      struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "%u\n", md->queue.urgent_budget_us);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+urgent_budget_us_store(struct device *dev,
+		       struct device_attribute *attr,
+		       const char *buf, size_t count)
+{
+	unsigned int value;
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	int ret = count;
+
+	/* 0 lets urgent reads stop any write, within urgent_max_intr */
+	if (!card || sscanf(buf, "%u", &value) != 1) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	md->queue.urgent_budget_us = value;
+
+	pr_debug("%s: urgent_budget_us: new value = %u",
+		mmc_hostname(card->host), md->queue.urgent_budget_us);
+
+exit:
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+urgent_max_intr_show(struct device *dev,
+		     struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "%u\n", md->queue.urgent_max_intr);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+urgent_max_intr_store(struct device *dev,
+		      struct device_attribute *attr,
+		      const char *buf, size_t count)
+{
+	unsigned int value;
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	int ret = count;
+
+	/* 0 never stops a running write */
+	if (!card || sscanf(buf, "%u", &value) != 1) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	md->queue.urgent_max_intr = value;
+
+	pr_debug("%s: urgent_max_intr: new value = %u",
+		mmc_hostname(card->host), md->queue.urgent_max_intr);
+
+exit:
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+urgent_stats_show(struct device *dev,
+		  struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_queue *mq = &md->queue;
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE,
+		       "preempted %lu denied %lu wasted_bytes %llu wr_kBps %u\n",
+		       mq->nr_preempted, mq->nr_preempt_denied,
+		       mq->preempt_wasted, mq->wr_bw);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+/* the partition dispatcher is per card, all partitions show the same */
+static ssize_t
+part_slice_ms_show(struct device *dev,
+		   struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_data *main_md = card ? mmc_get_drvdata(card) : md;
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "%u\n", main_md->part_slice_ms);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+part_slice_ms_store(struct device *dev,
+		    struct device_attribute *attr,
+		    const char *buf, size_t count)
+{
+	unsigned int value;
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_data *main_md;
+	int ret = count;
+
+	/* 0 lets a burst keep the host for as long as it lasts */
+	if (!card || sscanf(buf, "%u", &value) != 1) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	main_md = mmc_get_drvdata(card);
+	main_md->part_slice_ms = value;
+
+	pr_debug("%s: part_slice_ms: new value = %u",
+		mmc_hostname(card->host), main_md->part_slice_ms);
+
+exit:
+	mmc_blk_put(md);
+	return ret;
+}
+
+static ssize_t
+part_switch_stats_show(struct device *dev,
+		       struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = mmc_blk_get(dev_to_disk(dev));
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_data *main_md = card ? mmc_get_drvdata(card) : md;
+	int ret;
+
+	ret = snprintf(buf, PAGE_SIZE, "switches %lu time_us %llu yields %lu\n",
+		       main_md->part_switches,
+		       div_u64(main_md->part_switch_ns, NSEC_PER_USEC),
+		       main_md->part_yields);
+
+	mmc_blk_put(md);
+	return ret;
+}
+
 static int mmc_blk_open(struct block_device *bdev, fmode_t mode)
 {
 	struct mmc_blk_data *md = mmc_blk_get(bdev->bd_disk);
@@ -554,33 +865,29 @@ out:
 	return ERR_PTR(err);
 }
 
+/*
+ * Wait for the RPMB write to be programmed, the card gets @timeout_ms.
+ * A card still busy at the end, or still reporting an error once it is
+ * done, is -EPERM.
+ */
 static int ioctl_rpmb_card_status_poll(struct mmc_card *card, u32 *status,
-				       u32 retries_max)
+				       unsigned int timeout_ms)
 {
 	int err;
-	u32 retry_count = 0;
 
-	if (!status || !retries_max)
+	if (!status || !timeout_ms)
 		return -EINVAL;
 
-	do {
-		err = get_card_status(card, status, 5);
-		if (err)
-			break;
-
-		if (!R1_STATUS(*status) &&
-				(R1_CURRENT_STATE(*status) != R1_STATE_PRG))
-			break; /* RPMB programming operation complete */
-
-		/*
-		 * Rechedule to give the MMC device a chance to continue
-		 * processing the previous command without being polled too
-		 * frequently.
-		 */
-		usleep_range(1000, 5000);
-	} while (++retry_count < retries_max);
+	/* out of PRG is enough, CMD13 retried like get_card_status() */
+	err = __mmc_wait_busy(card, timeout_ms, false, false, 5, status);
+	if (err == -ETIMEDOUT)
+		return -EPERM;
+	if (err || !R1_STATUS(*status))
+		return err;
 
-	if (retry_count == retries_max)
+	/* error bits clear on read, see if the card still reports one */
+	err = get_card_status(card, status, 5);
+	if (!err && R1_STATUS(*status))
 		err = -EPERM;
 
 	return err;
@@ -884,7 +1191,8 @@ static int mmc_blk_ioctl_rpmb_cmd(struct block_device *bdev,
 		 * Ensure RPMB command has completed by polling CMD13
 		 * "Send Status".
 		 */
-		err = ioctl_rpmb_card_status_poll(card, &status, 5);
+		err = ioctl_rpmb_card_status_poll(card, &status,
+						  MMC_BLK_RPMB_POLL_MS);
 		if (err)
 			dev_err(mmc_dev(card->host),
 					"%s: Card Status=0x%08X, error %d\n",
@@ -943,6 +1251,7 @@ static inline int mmc_blk_part_switch(struct mmc_card *card,
 {
 	int ret;
 	struct mmc_blk_data *main_md = mmc_get_drvdata(card);
+	ktime_t start;
 
 	if ((main_md->part_curr == md->part_type) &&
 	    (card->part_curr == md->part_type))
@@ -954,11 +1263,15 @@ static inline int mmc_blk_part_switch(struct mmc_card *card,
 		part_config &= ~EXT_CSD_PART_CONFIG_ACC_MASK;
 		part_config |= md->part_type;
 
+		start = ktime_get();
 		ret = mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
 				 EXT_CSD_PART_CONFIG, part_config,
 				 card->ext_csd.part_time);
 		if (ret)
 			return ret;
+		main_md->part_switches++;
+		main_md->part_switch_ns +=
+			ktime_to_ns(ktime_sub(ktime_get(), start));
 
 		card->ext_csd.part_config = part_config;
 		card->part_curr = md->part_type;
@@ -1682,23 +1995,29 @@ static void mmc_blk_reinsert_req(struct mmc_async_req *areq)
 	int ret = 0;
 	struct mmc_queue_req *mq_rq;
 	struct request_queue *q;
+	struct mmc_queue *mq;
 
 	mq_rq = container_of(areq, struct mmc_queue_req, mmc_active);
 	q = mq_rq->req->q;
+	mq = q->queuedata;
+	memlog_block_add(mq->card->host->index, MEMLOG_BLK_REINSERT,
+			 blk_rq_pos(mq_rq->req), blk_rq_sectors(mq_rq->req),
+			 mq_rq->packed_num, 0);
 	if (mq_rq->packed_cmd != MMC_PACKED_NONE) {
+		/* urgent request is waiting, give them all back in one go */
+		spin_lock_irq(q->queue_lock);
 		while (!list_empty(&mq_rq->packed_list)) {
 			/* return requests in reverse order */
 			prq = list_entry_rq(mq_rq->packed_list.prev);
 			list_del_init(&prq->queuelist);
-			spin_lock_irq(q->queue_lock);
 			ret = blk_reinsert_request(q, prq);
 			if (ret) {
 				blk_requeue_request(q, prq);
 				spin_unlock_irq(q->queue_lock);
 				goto reinsert_error;
 			}
-			spin_unlock_irq(q->queue_lock);
 		}
+		spin_unlock_irq(q->queue_lock);
 	} else {
 		spin_lock_irq(q->queue_lock);
 		ret = blk_reinsert_request(q, mq_rq->req);
@@ -1725,6 +2044,27 @@ reinsert_error:
 	}
 }
 
+/*
+ * Point packed_fail_idx at the first request of the group that did not
+ * make it completely within the first @done bytes.
+ */
+static void mmc_blk_packed_set_fail_idx(struct mmc_queue_req *mq_rq,
+					int done)
+{
+	struct request *prq;
+	u8 req_index = 0;
+
+	list_for_each_entry(prq, &mq_rq->packed_list, queuelist) {
+		if ((done - (int)blk_rq_bytes(prq)) < 0) {
+			/* prq is not successfull */
+			mq_rq->packed_fail_idx = req_index;
+			break;
+		}
+		done -= blk_rq_bytes(prq);
+		req_index++;
+	}
+}
+
 /*
  * mmc_blk_update_interrupted_req() - update of the stopped request
  * @card:	the MMC card associated with the request.
@@ -1741,27 +2081,22 @@ static int mmc_blk_update_interrupted_req(struct mmc_card *card,
 					struct mmc_async_req *areq)
 {
 	int ret = MMC_BLK_SUCCESS;
-	u8 *ext_csd;
+	const u8 *ext_csd;
 	int correctly_done;
 	struct mmc_queue_req *mq_rq = container_of(areq, struct mmc_queue_req,
 				      mmc_active);
-	struct request *prq;
-	u8 req_index = 0;
 
 	if (mq_rq->packed_cmd == MMC_PACKED_NONE)
 		return MMC_BLK_SUCCESS;
 
-	ext_csd = kmalloc(512, GFP_KERNEL);
-	if (!ext_csd)
-		return MMC_BLK_ABORT;
-
 	/* get correctly programmed sectors number from card */
-	ret = mmc_send_ext_csd(card, ext_csd);
-	if (ret) {
-		pr_err("%s: error %d reading ext_csd\n",
-				mmc_hostname(card->host), ret);
-		ret = MMC_BLK_ABORT;
-		goto exit;
+	mmc_ext_csd_invalidate(card);
+	ext_csd = mmc_get_ext_csd_cached(card,
+			EXT_CSD_CORRECTLY_PRG_SECTORS_NUM, 4);
+	if (IS_ERR(ext_csd)) {
+		pr_err("%s: error %ld reading ext_csd\n",
+				mmc_hostname(card->host), PTR_ERR(ext_csd));
+		return MMC_BLK_ABORT;
 	}
 	correctly_done = card->ext_csd.data_sector_size *
 		(ext_csd[EXT_CSD_CORRECTLY_PRG_SECTORS_NUM + 0] << 0 |
@@ -1773,20 +2108,11 @@ static int mmc_blk_update_interrupted_req(struct mmc_card *card,
 	 * skip packed command header (1 sector) included by the counter but not
 	 * actually written to the NAND
 	 */
-	if (correctly_done >= card->ext_csd.data_sector_size)
+	if (mq_rq->packed_cmd == MMC_PACKED_WRITE &&
+			correctly_done >= card->ext_csd.data_sector_size)
 		correctly_done -= card->ext_csd.data_sector_size;
 
-	list_for_each_entry(prq, &mq_rq->packed_list, queuelist) {
-		if ((correctly_done - (int)blk_rq_bytes(prq)) < 0) {
-			/* prq is not successfull */
-			mq_rq->packed_fail_idx = req_index;
-			break;
-		}
-		correctly_done -= blk_rq_bytes(prq);
-		req_index++;
-	}
-exit:
-	kfree(ext_csd);
+	mmc_blk_packed_set_fail_idx(mq_rq, correctly_done);
 	return ret;
 }
 
@@ -1797,7 +2123,7 @@ static int mmc_blk_packed_err_check(struct mmc_card *card,
 			mmc_active);
 	struct request *req = mq_rq->req;
 	int err, check, status;
-	u8 ext_csd[512];
+	const u8 *ext_csd;
 
 	mq_rq->packed_retries--;
 	check = mmc_blk_err_check(card, areq);
@@ -1809,14 +2135,18 @@ static int mmc_blk_packed_err_check(struct mmc_card *card,
 	}
 
 	if (status & R1_EXCEPTION_EVENT) {
-		err = mmc_send_ext_csd(card, ext_csd);
-		if (err) {
-			pr_err("%s: error %d sending ext_csd\n",
-					req->rq_disk->disk_name, err);
-			return MMC_BLK_ABORT;
-		}
-
-		if ((ext_csd[EXT_CSD_EXP_EVENTS_STATUS] &
+		/* failure index, packed status and exception events */
+		mmc_ext_csd_invalidate(card);
+		ext_csd = mmc_get_ext_csd_cached(card,
+				EXT_CSD_PACKED_FAILURE_INDEX,
+				EXT_CSD_EXP_EVENTS_STATUS -
+				EXT_CSD_PACKED_FAILURE_INDEX + 1);
+		if (IS_ERR(ext_csd)) {
+			pr_err("%s: error %ld sending ext_csd\n",
+					req->rq_disk->disk_name,
+					PTR_ERR(ext_csd));
+			check = MMC_BLK_ABORT;
+		} else if ((ext_csd[EXT_CSD_EXP_EVENTS_STATUS] &
 					EXT_CSD_PACKED_FAILURE) &&
 				(ext_csd[EXT_CSD_PACKED_CMD_STATUS] &
 				 EXT_CSD_PACKED_GENERIC_ERROR)) {
@@ -1824,7 +2154,7 @@ static int mmc_blk_packed_err_check(struct mmc_card *card,
 					EXT_CSD_PACKED_INDEXED_ERROR) {
 				mq_rq->packed_fail_idx =
 				  ext_csd[EXT_CSD_PACKED_FAILURE_INDEX] - 1;
-				return MMC_BLK_PARTIAL;
+				check = MMC_BLK_PARTIAL;
 			}
 		}
 	}
@@ -1832,6 +2162,22 @@ static int mmc_blk_packed_err_check(struct mmc_card *card,
 	return check;
 }
 
+static int mmc_blk_merged_err_check(struct mmc_card *card,
+				    struct mmc_async_req *areq)
+{
+	struct mmc_queue_req *mq_rq = container_of(areq, struct mmc_queue_req,
+			mmc_active);
+	int check;
+
+	mq_rq->packed_retries--;
+	check = mmc_blk_err_check(card, areq);
+	if (check == MMC_BLK_PARTIAL)
+		mmc_blk_packed_set_fail_idx(mq_rq,
+					    mq_rq->brq.data.bytes_xfered);
+
+	return check;
+}
+
 static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
 			       struct mmc_card *card,
 			       int disable_multi,
@@ -2008,78 +2354,51 @@ void mmc_blk_disable_wr_packing(struct mmc_queue *mq)
 }
 EXPORT_SYMBOL(mmc_blk_disable_wr_packing);
 
-static int get_packed_trigger(int potential, struct mmc_card *card,
-			      struct request *req, int curr_trigger)
+/* fixed point EWMA with MMC_PACK_EWMA_SHIFT fraction bits */
+static inline void mmc_blk_ewma_add(int *avg, int sample)
 {
-	static int num_mean_elements = 1;
-	static unsigned long mean_potential = PCKD_TRGR_INIT_MEAN_POTEN;
-	unsigned int trigger = curr_trigger;
-	unsigned int pckd_trgr_upper_bound = card->ext_csd.max_packed_writes;
-
-	/* scale down the upper bound to 75% */
-	pckd_trgr_upper_bound = (pckd_trgr_upper_bound * 3) / 4;
+	*avg += ((sample << MMC_PACK_EWMA_SHIFT) - *avg) >>
+		PCKD_TRGR_EWMA_WEIGHT;
+}
 
-	/*
-	 * since the most common calls for this function are with small
-	 * potential write values and since we don't want these calls to affect
-	 * the packed trigger, set a lower bound and ignore calls with
-	 * potential lower than that bound
-	 */
-	if (potential <= PCKD_TRGR_POTEN_LOWER_BOUND)
-		return trigger;
+/*
+ * Adapt the number of potential packed writes needed to start packing.
+ * Each queue keeps an EWMA of its write burst length and of how often a
+ * burst gets cut short by an urgent read.  A burst longer than usual
+ * lowers the trigger and a shorter one raises it; the more often reads
+ * interrupt, the further it is pushed up, as packing then mostly delays
+ * those reads.
+ */
+static void mmc_blk_update_packed_trigger(struct mmc_queue *mq,
+					  struct request *req)
+{
+	int potential = mq->num_of_potential_packed_wr_reqs;
+	int trigger = mq->num_wr_reqs_to_start_packing;
+	int upper = (mq->card->ext_csd.max_packed_writes * 3) / 4;
+	bool urgent_rd = req && (req->cmd_flags & REQ_URGENT) &&
+		(rq_data_dir(req) == READ);
 
 	/*
-	 * this is to prevent integer overflow in the following calculation:
-	 * once every PACKED_TRIGGER_MAX_ELEMENTS reset the algorithm
+	 * short bursts are by far the most common and would drag the
+	 * average down, leave them out
 	 */
-	if (num_mean_elements > PACKED_TRIGGER_MAX_ELEMENTS) {
-		num_mean_elements = 1;
-		mean_potential = PCKD_TRGR_INIT_MEAN_POTEN;
-	}
+	if (potential <= PCKD_TRGR_POTEN_LOWER_BOUND)
+		return;
 
-	/*
-	 * get next mean value based on previous mean value and current
-	 * potential packed writes. Calculation is as follows:
-	 * mean_pot[i+1] =
-	 *	((mean_pot[i] * num_mean_elem) + potential)/(num_mean_elem + 1)
-	 */
-	mean_potential *= num_mean_elements;
-	/*
-	 * add num_mean_elements so that the division of two integers doesn't
-	 * lower mean_potential too much
-	 */
-	if (potential > mean_potential)
-		mean_potential += num_mean_elements;
-	mean_potential += potential;
-	/* this is for gaining more precision when dividing two integers */
-	mean_potential *= PCKD_TRGR_PRECISION_MULTIPLIER;
-	/* this completes the mean calculation */
-	mean_potential /= ++num_mean_elements;
-	mean_potential /= PCKD_TRGR_PRECISION_MULTIPLIER;
+	mmc_blk_ewma_add(&mq->wr_burst_avg, potential);
+	mmc_blk_ewma_add(&mq->rd_intr_avg, urgent_rd);
 
-	/*
-	 * if current potential packed writes is greater than the mean potential
-	 * then the heuristic is that the following workload will contain many
-	 * write requests, therefore we lower the packed trigger. In the
-	 * opposite case we want to increase the trigger in order to get less
-	 * packing events.
-	 */
-	if (potential >= mean_potential)
-		trigger = (trigger <= PCKD_TRGR_LOWER_BOUND) ?
-				PCKD_TRGR_LOWER_BOUND : trigger - 1;
+	if ((potential << MMC_PACK_EWMA_SHIFT) >= mq->wr_burst_avg)
+		trigger--;
 	else
-		trigger = (trigger >= pckd_trgr_upper_bound) ?
-				pckd_trgr_upper_bound : trigger + 1;
+		trigger++;
 
-	/*
-	 * an urgent read request indicates a packed list being interrupted
-	 * by this read, therefore we aim for less packing, hence the trigger
-	 * gets increased
-	 */
-	if (req && (req->cmd_flags & REQ_URGENT) && (rq_data_dir(req) == READ))
-		trigger += PCKD_TRGR_URGENT_PENALTY;
+	/* up to PCKD_TRGR_URGENT_PENALTY when every burst gets cut */
+	trigger += (mq->rd_intr_avg * PCKD_TRGR_URGENT_PENALTY +
+		    (1 << (MMC_PACK_EWMA_SHIFT - 1))) >> MMC_PACK_EWMA_SHIFT;
 
-	return trigger;
+	mq->num_wr_reqs_to_start_packing = clamp(trigger,
+		PCKD_TRGR_LOWER_BOUND, max(upper, PCKD_TRGR_LOWER_BOUND));
 }
 
 static void mmc_blk_write_packing_control(struct mmc_queue *mq,
@@ -2109,10 +2428,7 @@ static void mmc_blk_write_packing_control(struct mmc_queue *mq,
 		if (mq->num_of_potential_packed_wr_reqs >
 				mq->num_wr_reqs_to_start_packing)
 			mq->wr_packing_enabled = true;
-		mq->num_wr_reqs_to_start_packing =
-			get_packed_trigger(mq->num_of_potential_packed_wr_reqs,
-					   mq->card, req,
-					   mq->num_wr_reqs_to_start_packing);
+		mmc_blk_update_packed_trigger(mq, req);
 		mq->num_of_potential_packed_wr_reqs = 0;
 		return;
 	}
@@ -2120,13 +2436,9 @@ static void mmc_blk_write_packing_control(struct mmc_queue *mq,
 	data_dir = rq_data_dir(req);
 
 	if (data_dir == READ) {
+		/* account the burst this read ends before dropping it */
+		mmc_blk_update_packed_trigger(mq, req);
 		mmc_blk_disable_wr_packing(mq);
-		mq->num_wr_reqs_to_start_packing =
-			get_packed_trigger(mq->num_of_potential_packed_wr_reqs,
-					   mq->card, req,
-					   mq->num_wr_reqs_to_start_packing);
-		mq->num_of_potential_packed_wr_reqs = 0;
-		mq->wr_packing_enabled = false;
 		return;
 	} else if (data_dir == WRITE) {
 		mq->num_of_potential_packed_wr_reqs++;
@@ -2162,6 +2474,10 @@ void mmc_blk_init_packed_statistics(struct mmc_card *card)
 	       sizeof(*card->wr_pack_stats.packing_events));
 	memset(&card->wr_pack_stats.pack_stop_reason, 0,
 		sizeof(card->wr_pack_stats.pack_stop_reason));
+	if (card->wr_pack_stats.limit_stats)
+		memset(card->wr_pack_stats.limit_stats, 0,
+		       (max_num_of_packed_reqs + 1) *
+		       sizeof(*card->wr_pack_stats.limit_stats));
 	card->wr_pack_stats.enabled = true;
 	spin_unlock(&card->wr_pack_stats.lock);
 }
@@ -2179,7 +2495,9 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 	u8 put_back = 0;
 	u8 max_packed_rw = 0;
 	u8 reqs = 0;
-	struct mmc_wr_pack_stats *stats = &card->wr_pack_stats;
+	u8 stop = MAX_REASONS;
+	/* the packing statistics only cover writes */
+	struct mmc_wr_pack_stats *stats = NULL;
 
 	mmc_blk_clear_packed(mq->mqrq_cur);
 
@@ -2187,21 +2505,21 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 			!card->ext_csd.packed_event_en)
 		goto no_packed;
 
-	if (!mq->wr_packing_enabled)
-		goto no_packed;
-
-	if ((rq_data_dir(cur) == WRITE) &&
-			(card->host->caps2 & MMC_CAP2_PACKED_WR))
+	if (rq_data_dir(cur) == READ) {
+		/* an urgent read must not wait for the rest of a group */
+		if ((card->host->caps2 & MMC_CAP2_PACKED_RD) &&
+				!(cur->cmd_flags & REQ_URGENT))
+			max_packed_rw = card->ext_csd.max_packed_reads;
+	} else if (mq->wr_packing_enabled &&
+			(card->host->caps2 & MMC_CAP2_PACKED_WR)) {
 		max_packed_rw = card->ext_csd.max_packed_writes;
+		stats = &card->wr_pack_stats;
+	}
 
+	max_packed_rw = mmc_blk_packed_limit(mq, max_packed_rw);
 	if (max_packed_rw == 0)
 		goto no_packed;
 
-/* LGE_UPDATE_S by p1-fs@lge.com Toshiba recommend packed number no over 8 */
-	else if(max_packed_rw > 8)
-		max_packed_rw = 8;
-/* LGE_UPDATE_E by p1-fs@lge.com */
-
 	if (mmc_req_rel_wr(cur) &&
 			(md->flags & MMC_BLK_REL_WR) &&
 			!en_rel_wr)
@@ -2228,19 +2546,25 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 		phys_segments++;
 	}
 
-	spin_lock(&stats->lock);
+	if (stats)
+		spin_lock(&stats->lock);
 
+	/*
+	 * The checks below are cheap, so keep queue_lock across the whole
+	 * gather instead of bouncing it for every request we pull.
+	 */
+	spin_lock_irq(q->queue_lock);
 	while (reqs < max_packed_rw - 1) {
-		spin_lock_irq(q->queue_lock);
 		next = blk_fetch_request(q);
-		spin_unlock_irq(q->queue_lock);
 		if (!next) {
+			stop = EMPTY_QUEUE;
 			MMC_BLK_UPDATE_STOP_REASON(stats, EMPTY_QUEUE);
 			break;
 		}
 
 		if (mmc_large_sec(card) &&
 				!IS_ALIGNED(blk_rq_sectors(next), 8)) {
+			stop = LARGE_SEC_ALIGN;
 			MMC_BLK_UPDATE_STOP_REASON(stats, LARGE_SEC_ALIGN);
 			put_back = 1;
 			break;
@@ -2248,18 +2572,21 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 
 		if (next->cmd_flags & REQ_DISCARD ||
 				next->cmd_flags & REQ_FLUSH) {
+			stop = FLUSH_OR_DISCARD;
 			MMC_BLK_UPDATE_STOP_REASON(stats, FLUSH_OR_DISCARD);
 			put_back = 1;
 			break;
 		}
 
 		if (next->cmd_flags & REQ_FUA) {
+			stop = FUA;
 			MMC_BLK_UPDATE_STOP_REASON(stats, FUA);
 			put_back = 1;
 			break;
 		}
 
 		if (rq_data_dir(cur) != rq_data_dir(next)) {
+			stop = WRONG_DATA_DIR;
 			MMC_BLK_UPDATE_STOP_REASON(stats, WRONG_DATA_DIR);
 			put_back = 1;
 			break;
@@ -2268,6 +2595,7 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 		if (mmc_req_rel_wr(next) &&
 				(md->flags & MMC_BLK_REL_WR) &&
 				!en_rel_wr) {
+			stop = REL_WRITE;
 			MMC_BLK_UPDATE_STOP_REASON(stats, REL_WRITE);
 			put_back = 1;
 			break;
@@ -2275,14 +2603,15 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 
 		req_sectors += blk_rq_sectors(next);
 		if (req_sectors > max_blk_count) {
-			if (stats->enabled)
-				stats->pack_stop_reason[EXCEEDS_SECTORS]++;
+			stop = EXCEEDS_SECTORS;
+			MMC_BLK_UPDATE_STOP_REASON(stats, EXCEEDS_SECTORS);
 			put_back = 1;
 			break;
 		}
 
 		phys_segments +=  next->nr_phys_segments;
 		if (phys_segments > max_phys_segs) {
+			stop = EXCEEDS_SEGMENTS;
 			MMC_BLK_UPDATE_STOP_REASON(stats, EXCEEDS_SEGMENTS);
 			put_back = 1;
 			break;
@@ -2291,6 +2620,7 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 		if (mq->no_pack_for_random) {
 			if ((blk_rq_pos(cur) + blk_rq_sectors(cur)) !=
 			    blk_rq_pos(next)) {
+				stop = RANDOM;
 				MMC_BLK_UPDATE_STOP_REASON(stats, RANDOM);
 				put_back = 1;
 				break;
@@ -2308,25 +2638,29 @@ static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
 		reqs++;
 	}
 
-	if (put_back) {
-		spin_lock_irq(q->queue_lock);
+	if (put_back)
 		blk_requeue_request(q, next);
-		spin_unlock_irq(q->queue_lock);
-	}
-
-	if (stats->enabled) {
-		if (reqs + 1 <= card->ext_csd.max_packed_writes)
-			stats->packing_events[reqs + 1]++;
-		if (reqs + 1 == max_packed_rw)
-			MMC_BLK_UPDATE_STOP_REASON(stats, THRESHOLD);
+	spin_unlock_irq(q->queue_lock);
+
+	if (reqs + 1 == max_packed_rw)
+		stop = THRESHOLD;
+	if (stats) {
+		if (stats->enabled) {
+			if (reqs + 1 <= card->ext_csd.max_packed_writes)
+				stats->packing_events[reqs + 1]++;
+			if (stop == THRESHOLD)
+				MMC_BLK_UPDATE_STOP_REASON(stats, THRESHOLD);
+		}
+		spin_unlock(&stats->lock);
 	}
 
-	spin_unlock(&stats->lock);
-
 	if (reqs > 0) {
 		list_add(&req->queuelist, &mq->mqrq_cur->packed_list);
 		mq->mqrq_cur->packed_num = ++reqs;
 		mq->mqrq_cur->packed_retries = reqs;
+		mq->mqrq_cur->packed_limit = max_packed_rw;
+		memlog_block_add(card->host->index, MEMLOG_BLK_PACK,
+				 blk_rq_pos(req), req_sectors, reqs, stop);
 		return reqs;
 	}
 
@@ -2335,19 +2669,50 @@ no_packed:
 	return 0;
 }
 
+/*
+ * Account a finished packed write to the limit it was packed under, so
+ * the throughput of different limits can be compared in debugfs.
+ */
+static void mmc_blk_packed_limit_account(struct mmc_card *card,
+					 struct mmc_queue_req *mqrq)
+{
+	struct mmc_wr_pack_stats *stats = &card->wr_pack_stats;
+	struct mmc_pack_limit_stats *ls;
+	struct mmc_request *mrq = &mqrq->brq.mrq;
+
+	if (mqrq->packed_cmd != MMC_PACKED_WRITE || !stats->limit_stats ||
+	    mqrq->packed_limit > card->ext_csd.max_packed_writes)
+		return;
+
+	spin_lock(&stats->lock);
+	if (stats->enabled) {
+		ls = &stats->limit_stats[mqrq->packed_limit];
+		ls->groups++;
+		ls->reqs += mqrq->packed_num;
+		/* payload only, less the header block */
+		if (mqrq->brq.data.bytes_xfered >> 9)
+			ls->sectors += (mqrq->brq.data.bytes_xfered >> 9) - 1;
+		if (mrq->done_time > mrq->dispatch_time)
+			ls->busy_ns += mrq->done_time - mrq->dispatch_time;
+	}
+	spin_unlock(&stats->lock);
+}
+
 static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 					struct mmc_card *card,
 					struct mmc_queue *mq)
 {
 	struct mmc_blk_request *brq = &mqrq->brq;
+	struct mmc_blk_request *hdr = &mqrq->packed_hdr_brq;
 	struct request *req = mqrq->req;
 	struct request *prq;
 	struct mmc_blk_data *md = mq->data;
 	bool do_rel_wr, do_data_tag;
+	bool read = rq_data_dir(req) == READ;
 	u32 *packed_cmd_hdr = mqrq->packed_cmd_hdr;
 	u8 i = 1;
 
-	mqrq->packed_cmd = MMC_PACKED_WRITE;
+	mqrq->packed_cmd = read ? MMC_PACKED_READ : MMC_PACKED_WRITE;
 	mqrq->packed_blocks = 0;
 	mqrq->packed_fail_idx = MMC_PACKED_N_IDX;
 
@@ -2356,7 +2721,7 @@ static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 	memset(lge_packed_cmd_info.packed_cmd_hdr, 0, sizeof(lge_packed_cmd_info.packed_cmd_hdr));
 #endif
 	packed_cmd_hdr[0] = (mqrq->packed_num << 16) |
-		(PACKED_CMD_WR << 8) | PACKED_CMD_VER;
+		((read ? PACKED_CMD_RD : PACKED_CMD_WR) << 8) | PACKED_CMD_VER;
 
 #if defined(CONFIG_FMBT_TRACE_EMMC)
 	lge_packed_cmd_info.num_packed = mqrq->packed_num;
@@ -2393,7 +2758,7 @@ static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 	}
 
 #if defined(CONFIG_FMBT_TRACE_EMMC)
-	lge_packed_cmd_info.packed_blocks = mqrq->packed_blocks +1;
+	lge_packed_cmd_info.packed_blocks = mqrq->packed_blocks + (read ? 0 : 1);
 #endif
 
 	memset(brq, 0, sizeof(struct mmc_blk_request));
@@ -2402,19 +2767,26 @@ static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 	brq->mrq.sbc = &brq->sbc;
 	brq->mrq.stop = &brq->stop;
 
+	/*
+	 * A packed write carries the header as its first block.  A packed
+	 * read gets it written ahead by a one block CMD25 to the first
+	 * address, then reads back the data of all entries with CMD18.
+	 */
 	brq->sbc.opcode = MMC_SET_BLOCK_COUNT;
-	brq->sbc.arg = MMC_CMD23_ARG_PACKED | (mqrq->packed_blocks + 1);
+	brq->sbc.arg = MMC_CMD23_ARG_PACKED |
+		(mqrq->packed_blocks + (read ? 0 : 1));
 	brq->sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
 
-	brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	brq->cmd.opcode = read ? MMC_READ_MULTIPLE_BLOCK :
+		MMC_WRITE_MULTIPLE_BLOCK;
 	brq->cmd.arg = blk_rq_pos(req);
 	if (!mmc_card_blockaddr(card))
 		brq->cmd.arg <<= 9;
 	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
 
 	brq->data.blksz = 512;
-	brq->data.blocks = mqrq->packed_blocks + 1;
-	brq->data.flags |= MMC_DATA_WRITE;
+	brq->data.blocks = mqrq->packed_blocks + (read ? 0 : 1);
+	brq->data.flags |= read ? MMC_DATA_READ : MMC_DATA_WRITE;
 	brq->data.fault_injected = false;
 
 	brq->stop.opcode = MMC_STOP_TRANSMISSION;
@@ -2426,6 +2798,37 @@ static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 	brq->data.sg = mqrq->sg;
 	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
 
+	if (read) {
+		memset(hdr, 0, sizeof(struct mmc_blk_request));
+		hdr->mrq.cmd = &hdr->cmd;
+		hdr->mrq.data = &hdr->data;
+		hdr->mrq.sbc = &hdr->sbc;
+		hdr->mrq.stop = &hdr->stop;
+
+		hdr->sbc.opcode = MMC_SET_BLOCK_COUNT;
+		hdr->sbc.arg = MMC_CMD23_ARG_PACKED | 1;
+		hdr->sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+		hdr->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+		hdr->cmd.arg = brq->cmd.arg;
+		hdr->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+		hdr->stop.opcode = MMC_STOP_TRANSMISSION;
+		hdr->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+
+		hdr->data.blksz = 512;
+		hdr->data.blocks = 1;
+		hdr->data.flags = MMC_DATA_WRITE;
+		mmc_set_data_timeout(&hdr->data, card);
+
+		sg_init_one(&mqrq->packed_hdr_sg, packed_cmd_hdr,
+			    sizeof(mqrq->packed_cmd_hdr));
+		hdr->data.sg = &mqrq->packed_hdr_sg;
+		hdr->data.sg_len = 1;
+
+		brq->mrq.pre_mrq = &hdr->mrq;
+	}
+
 	mqrq->mmc_active.mrq = &brq->mrq;
 	mqrq->mmc_active.cmd_flags = req->cmd_flags;
 
@@ -2449,6 +2852,103 @@ static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
 	mmc_queue_bounce_pre(mqrq);
 }
 
+/*
+ * A group gathered for packing whose requests follow each other on the
+ * card is better off as one plain CMD18/CMD25: no header block and no
+ * packed status to check.  Reliable writes keep their own CMD23 flags,
+ * and the packed command tests get the packed commands they ask for.
+ */
+static bool mmc_blk_packed_contig(struct mmc_queue *mq,
+				  struct mmc_queue_req *mqrq)
+{
+	struct request *prq;
+	sector_t next = blk_rq_pos(mqrq->req);
+
+	if (mq->packed_test_fn)
+		return false;
+
+	list_for_each_entry(prq, &mqrq->packed_list, queuelist) {
+		if (blk_rq_pos(prq) != next || mmc_req_rel_wr(prq))
+			return false;
+		next += blk_rq_sectors(prq);
+	}
+
+	return true;
+}
+
+static void mmc_blk_merged_rq_prep(struct mmc_queue_req *mqrq,
+				   struct mmc_card *card,
+				   struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	struct request *prq;
+
+	mqrq->packed_cmd = MMC_PACKED_MERGED;
+	mqrq->packed_blocks = 0;
+	mqrq->packed_fail_idx = MMC_PACKED_N_IDX;
+
+	list_for_each_entry(prq, &mqrq->packed_list, queuelist)
+		mqrq->packed_blocks += blk_rq_sectors(prq);
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	brq->mrq.sbc = &brq->sbc;
+	brq->mrq.stop = &brq->stop;
+
+	brq->sbc.opcode = MMC_SET_BLOCK_COUNT;
+	brq->sbc.arg = mqrq->packed_blocks;
+	brq->sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = MMC_READ_MULTIPLE_BLOCK;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	brq->data.blksz = 512;
+	brq->data.blocks = mqrq->packed_blocks;
+	brq->data.fault_injected = false;
+
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.cmd_flags = req->cmd_flags;
+	if (mq->err_check_fn)
+		mqrq->mmc_active.err_check = mq->err_check_fn;
+	else
+		mqrq->mmc_active.err_check = mmc_blk_merged_err_check;
+	mqrq->mmc_active.reinsert_req = mmc_blk_reinsert_req;
+	mqrq->mmc_active.update_interrupted_req =
+		mmc_blk_update_interrupted_req;
+
+	mmc_queue_bounce_pre(mqrq);
+}
+
+static void mmc_blk_packed_rq_prep(struct mmc_queue_req *mqrq,
+				   struct mmc_card *card,
+				   struct mmc_queue *mq)
+{
+	if (mmc_blk_packed_contig(mq, mqrq))
+		mmc_blk_merged_rq_prep(mqrq, card, mq);
+	else
+		mmc_blk_packed_hdr_wrq_prep(mqrq, card, mq);
+}
+
 static int mmc_blk_cmd_err(struct mmc_blk_data *md, struct mmc_card *card,
 			   struct mmc_blk_request *brq, struct request *req,
 			   int ret)
@@ -2543,6 +3043,95 @@ static void mmc_blk_revert_packed_req(struct mmc_queue *mq,
 	mmc_blk_clear_packed(mq_rq);
 }
 
+static bool mmc_blk_can_prep_ahead(struct request *req)
+{
+	/*
+	 * Only plain reads and writes, anything that needs the queue
+	 * drained first or must not be reinserted is left to the thread.
+	 */
+	return req->cmd_type == REQ_TYPE_FS &&
+		!(req->cmd_flags & (REQ_DISCARD | REQ_SANITIZE |
+				    MMC_REQ_NOREINSERT_MASK));
+}
+
+/*
+ * Fill the spare slots behind mqrq_cur while the previous request keeps
+ * the device busy: fetch, map and, on hosts that allow it, pre_req()
+ * them now so the thread only has to start them later.
+ */
+static void mmc_blk_prep_ahead(struct mmc_queue *mq)
+{
+	struct mmc_card *card = mq->card;
+	struct mmc_host *host = card->host;
+	struct request_queue *q = mq->queue;
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	struct request *next;
+	int i;
+
+	/* packed writes gather from the queue themselves */
+	if (!host->areq || mq->wr_packing_enabled)
+		return;
+
+	for (i = 0; i < mq->nr_ahead; i++)
+		mqrq = mmc_queue_next_slot(mq, mqrq);
+
+	while (mq->nr_ahead < mq->qdepth - 2 &&
+	       !host->context_info.is_urgent) {
+		spin_lock_irq(q->queue_lock);
+		next = blk_fetch_request(q);
+		if (next && !mmc_blk_can_prep_ahead(next)) {
+			blk_requeue_request(q, next);
+			next = NULL;
+		}
+		spin_unlock_irq(q->queue_lock);
+		if (!next)
+			break;
+
+		memlog_block_add(host->index, MEMLOG_BLK_FETCH,
+				 blk_rq_pos(next), blk_rq_sectors(next),
+				 rq_data_dir(next), 0);
+		if (card->ext_csd.bkops_en && rq_data_dir(next) == WRITE)
+			card->bkops_info.sectors_changed +=
+				blk_rq_sectors(next);
+
+		mqrq = mmc_queue_next_slot(mq, mqrq);
+		mqrq->req = next;
+		mqrq->ahead = true;
+		mmc_blk_rw_rq_prep(mqrq, card, 0, mq);
+		mmc_prep_async_req(host, &mqrq->mmc_active);
+		mq->nr_ahead++;
+	}
+}
+
+/*
+ * Give the requests prepared ahead back to the block layer, newest
+ * first so they keep their order.  Used when an urgent request or an
+ * error breaks the pipeline.
+ */
+static void mmc_blk_unwind_ahead(struct mmc_queue *mq)
+{
+	struct request_queue *q = mq->queue;
+	struct mmc_queue_req *mqrq;
+	int i, j;
+
+	for (i = mq->nr_ahead; i > 0; i--) {
+		mqrq = mq->mqrq_cur;
+		for (j = 0; j < i; j++)
+			mqrq = mmc_queue_next_slot(mq, mqrq);
+
+		mmc_unprep_async_req(mq->card->host, &mqrq->mmc_active);
+		spin_lock_irq(q->queue_lock);
+		if (blk_reinsert_request(q, mqrq->req))
+			blk_requeue_request(q, mqrq->req);
+		spin_unlock_irq(q->queue_lock);
+
+		mqrq->brq.mrq.data = NULL;
+		mqrq->req = NULL;
+		mqrq->ahead = false;
+	}
+	mq->nr_ahead = 0;
+}
+
 static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 {
 	struct mmc_blk_data *md = mq->data;
@@ -2559,7 +3148,7 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 	if (!rqc && !mq->mqrq_prev->req)
 		return 0;
 
-	if (rqc) {
+	if (rqc && !mq->mqrq_cur->ahead) {
 		if ((card->ext_csd.bkops_en) && (rq_data_dir(rqc) == WRITE))
 			card->bkops_info.sectors_changed += blk_rq_sectors(rqc);
 		reqs = mmc_blk_prep_packed_list(mq, rqc);
@@ -2567,15 +3156,21 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 
 	do {
 		if (rqc) {
-			if (reqs >= packed_num)
-				mmc_blk_packed_hdr_wrq_prep(mq->mqrq_cur,
+			if (mq->mqrq_cur->ahead)
+				/* mmc_blk_prep_ahead() did the work */
+				mq->mqrq_cur->ahead = false;
+			else if (reqs >= packed_num)
+				mmc_blk_packed_rq_prep(mq->mqrq_cur,
 						card, mq);
 			else
 				mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
 			areq = &mq->mqrq_cur->mmc_active;
+			mmc_blk_prep_ahead(mq);
 		} else
 			areq = NULL;
 		areq = mmc_start_req(card->host, areq, (int *) &status);
+		if (status == MMC_BLK_URGENT || status == MMC_BLK_URGENT_DONE)
+			mmc_blk_unwind_ahead(mq);
 		if (!areq) {
 			if (status == MMC_BLK_NEW_REQUEST)
 				mq->flags |= MMC_QUEUE_NEW_REQUEST;
@@ -2590,6 +3185,9 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 
 		switch (status) {
 		case MMC_BLK_URGENT:
+			if (type == MMC_BLK_WRITE)
+				mmc_queue_account_preempt(mq, mq_rq,
+					card->host->context_info.stop_remain);
 			if (mq_rq->packed_cmd != MMC_PACKED_NONE) {
 				/* complete successfully transmitted part */
 				if (mmc_blk_end_packed_req(mq_rq))
@@ -2609,8 +3207,11 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 			 * A block was successfully transferred.
 			 */
 			mmc_blk_reset_success(md, type);
+			if (type == MMC_BLK_WRITE)
+				mmc_queue_account_write(mq, mq_rq);
 
 			if (mq_rq->packed_cmd != MMC_PACKED_NONE) {
+				mmc_blk_packed_limit_account(card, mq_rq);
 				ret = mmc_blk_end_packed_req(mq_rq);
 				break;
 			} else {
@@ -2656,6 +3257,16 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 			/* Fall through */
 		}
 		case MMC_BLK_ECC_ERR:
+			if (mq_rq->packed_cmd != MMC_PACKED_NONE) {
+				/*
+				 * Give the rest of the group back and find
+				 * the bad sector in the first request alone.
+				 */
+				mmc_blk_revert_packed_req(mq, mq_rq);
+				disable_multi = 1;
+				ret = 1;
+				break;
+			}
 			if (brq->data.blocks > 1) {
 				/* Redo read one sector at a time */
 				pr_warning("%s: retrying using single block read\n",
@@ -2695,7 +3306,7 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 			} else {
 				if (!mq_rq->packed_retries)
 					goto cmd_abort;
-				mmc_blk_packed_hdr_wrq_prep(mq_rq, card, mq);
+				mmc_blk_packed_rq_prep(mq_rq, card, mq);
 				mmc_start_req(card->host,
 						&mq_rq->mmc_active, NULL);
 			}
@@ -2705,6 +3316,7 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 	return 1;
 
  cmd_abort:
+	mmc_blk_unwind_ahead(mq);
 	if (mq_rq->packed_cmd == MMC_PACKED_NONE) {
 		if (mmc_card_removed(card))
 			req->cmd_flags |= REQ_QUIET;
@@ -2739,6 +3351,350 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 	return 0;
 }
 
+/*
+ * eMMC command queuing.  Tasks are queued with CMD44/CMD45, the queue
+ * status register (CMD13 with SQS) tells which ones the card is ready
+ * to run and CMD46/CMD47 move their data, in the order the card picked.
+ * Like the packed path a burst is drained before returning, so the
+ * queue thread still sees one finished request per call.
+ */
+#define MMC_CMDQ_TIMEOUT_MS	5000	/* no task became ready */
+#define MMC_CMDQ_MAX_ERRORS	3	/* recoveries before giving up */
+/* back-off between QSR polls while no task is ready */
+#define MMC_CMDQ_POLL_MIN_US	32
+#define MMC_CMDQ_POLL_MAX_US	1024
+
+static bool mmc_blk_cmdq_able(struct mmc_queue *mq, struct request *req)
+{
+	return req && mq->cmdq && !mq->cmdq->broken &&
+		!mq->mqrq_cur->ahead &&
+		req->cmd_type == REQ_TYPE_FS &&
+		!(req->cmd_flags & (REQ_DISCARD | REQ_FLUSH | REQ_SANITIZE)) &&
+		blk_rq_sectors(req) <= MMC_CMDQ_MAX_BLOCKS;
+}
+
+/* leave command queue mode, the queue must be empty */
+static void mmc_blk_cmdq_off(struct mmc_queue *mq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = mq->card;
+	int err;
+
+	err = mmc_cmdq_enable(card, false);
+	if (!err)
+		return;
+
+	pr_err("%s: failed to leave command queue mode (%d), resetting\n",
+		md->disk->disk_name, err);
+	if (mq->cmdq)
+		mq->cmdq->broken = true;
+	/* a re-init leaves CMDQ_MODE_EN cleared */
+	if (mmc_hw_reset(card->host) != -EOPNOTSUPP)
+		md->part_curr = md->part_type;
+}
+
+/* queue @req as a task, requeues it to the block layer on failure */
+static int mmc_blk_cmdq_queue(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = mq->card;
+	struct mmc_cmdq *cmdq = mq->cmdq;
+	struct mmc_cmdq_task *task;
+	struct mmc_blk_request *brq;
+	u32 params, addr;
+	int tag, err;
+
+	tag = find_first_zero_bit(&cmdq->busy, cmdq->depth);
+	task = &cmdq->tasks[tag];
+	brq = &task->brq;
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+
+	params = MMC_CMDQ_TASK_ID(tag) | blk_rq_sectors(req);
+	if (rq_data_dir(req) == READ) {
+		params |= MMC_CMDQ_READ;
+		brq->cmd.opcode = MMC_EXECUTE_READ_TASK;
+		brq->data.flags = MMC_DATA_READ;
+	} else {
+		/* same reliable write policy as mmc_blk_rw_rq_prep() */
+		if ((req->cmd_flags & (REQ_FUA | REQ_META)) &&
+		    (md->flags & MMC_BLK_REL_WR))
+			params |= MMC_CMDQ_REL_WR;
+		brq->cmd.opcode = MMC_EXECUTE_WRITE_TASK;
+		brq->data.flags = MMC_DATA_WRITE;
+	}
+	if (req->cmd_flags & REQ_URGENT)
+		params |= MMC_CMDQ_PRIO_HIGH;
+
+	addr = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		addr <<= 9;
+
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	brq->cmd.arg = MMC_CMDQ_TASK_ID(tag);
+	brq->cmd.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->data.blocks = blk_rq_sectors(req);
+	brq->data.sg = task->sg;
+	brq->data.sg_len = blk_rq_map_sg(mq->queue, req, task->sg);
+	mmc_set_data_timeout(&brq->data, card);
+
+	err = mmc_cmdq_queue_task(card, params, addr);
+	if (err) {
+		spin_lock_irq(mq->queue->queue_lock);
+		blk_requeue_request(mq->queue, req);
+		spin_unlock_irq(mq->queue->queue_lock);
+		return err;
+	}
+
+	task->req = req;
+	__set_bit(tag, &cmdq->busy);
+	card->ext_csd.cmdq_tasks = ++cmdq->nr_queued;
+	return 0;
+}
+
+static int mmc_blk_cmdq_exec(struct mmc_queue *mq, int tag)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_cmdq *cmdq = mq->cmdq;
+	struct mmc_cmdq_task *task = &cmdq->tasks[tag];
+	struct mmc_blk_request *brq = &task->brq;
+	struct request *req = task->req;
+	int err;
+
+	mmc_wait_for_req(mq->card->host, &brq->mrq);
+	err = brq->cmd.error ? brq->cmd.error : brq->data.error;
+	if (!err && (brq->cmd.resp[0] & R1_CMDQ_ERRORS))
+		err = -EIO;
+	/* the card didn't complain, the rest is retried, not dropped */
+	if (!err && brq->data.bytes_xfered < blk_rq_bytes(req)) {
+		pr_warning("%s: task %d short: %u of %u bytes\n",
+			md->disk->disk_name, tag,
+			brq->data.bytes_xfered, blk_rq_bytes(req));
+		err = -EIO;
+	}
+	if (err)
+		return err;
+
+	__clear_bit(tag, &cmdq->busy);
+	mq->card->ext_csd.cmdq_tasks = --cmdq->nr_queued;
+	task->req = NULL;
+	blk_end_request(req, 0, brq->data.bytes_xfered);
+
+	return 0;
+}
+
+/*
+ * Halt: discard what the card still holds, leave command queue mode and
+ * give the unfinished requests back.  The part of @failed (a tag, or -1)
+ * the card did transfer is completed first.  The rest are retried as
+ * tasks, after MMC_CMDQ_MAX_ERRORS recoveries in a row the legacy path,
+ * with its finer grained error handling, takes over for good.
+ */
+static void mmc_blk_cmdq_recover(struct mmc_queue *mq, int err, int failed)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_cmdq *cmdq = mq->cmdq;
+	struct request_queue *q = mq->queue;
+	struct mmc_cmdq_task *task;
+	int tag;
+
+	pr_warning("%s: command queue error %d, requeueing %d tasks\n",
+		md->disk->disk_name, err, cmdq->nr_queued);
+
+	mmc_cmdq_discard(mq->card, MMC_CMDQ_DISCARD_QUEUE, 0);
+
+	if (failed >= 0) {
+		task = &cmdq->tasks[failed];
+		if (task->brq.data.bytes_xfered &&
+		    !blk_end_request(task->req, 0,
+				     task->brq.data.bytes_xfered)) {
+			/* all of it made it after all */
+			__clear_bit(failed, &cmdq->busy);
+			task->req = NULL;
+		}
+	}
+
+	/* each requeue goes in front, so from the newest tag down */
+	spin_lock_irq(q->queue_lock);
+	for (tag = cmdq->depth - 1; tag >= 0; tag--) {
+		if (!test_bit(tag, &cmdq->busy))
+			continue;
+		blk_requeue_request(q, cmdq->tasks[tag].req);
+		cmdq->tasks[tag].req = NULL;
+	}
+	spin_unlock_irq(q->queue_lock);
+	cmdq->busy = 0;
+	cmdq->nr_queued = 0;
+	mq->card->ext_csd.cmdq_tasks = 0;
+
+	if (++cmdq->errors >= MMC_CMDQ_MAX_ERRORS) {
+		pr_err("%s: too many command queue errors, not using it\n",
+			md->disk->disk_name);
+		cmdq->broken = true;
+	}
+	mmc_blk_cmdq_off(mq);
+}
+
+static int mmc_blk_issue_cmdq_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_card *card = mq->card;
+	struct mmc_cmdq *cmdq = mq->cmdq;
+	struct request_queue *q = mq->queue;
+	struct request *next;
+	unsigned long timeout, ready;
+	unsigned int delay_us = MMC_CMDQ_POLL_MIN_US;
+	u32 qsr;
+	int tag = -1, err;
+
+	if (!card->ext_csd.cmdq_en) {
+		err = mmc_cmdq_enable(card, true);
+		if (err) {
+			pr_warning("%s: can't enable command queue (%d)\n",
+				mmc_hostname(card->host), err);
+			cmdq->broken = true;
+			return mmc_blk_issue_rw_rq(mq, req);
+		}
+	}
+
+	err = mmc_blk_cmdq_queue(mq, req);
+	if (err)
+		goto recover;
+
+	/* hand the card everything the block layer already has */
+	while (cmdq->nr_queued < cmdq->depth) {
+		spin_lock_irq(q->queue_lock);
+		next = blk_fetch_request(q);
+		if (next && !mmc_blk_cmdq_able(mq, next)) {
+			blk_requeue_request(q, next);
+			next = NULL;
+		}
+		spin_unlock_irq(q->queue_lock);
+		if (!next)
+			break;
+
+		memlog_block_add(card->host->index, MEMLOG_BLK_FETCH,
+				 blk_rq_pos(next), blk_rq_sectors(next),
+				 rq_data_dir(next), 0);
+		err = mmc_blk_cmdq_queue(mq, next);
+		if (err)
+			goto recover;
+	}
+
+	timeout = jiffies + msecs_to_jiffies(MMC_CMDQ_TIMEOUT_MS);
+	while (cmdq->busy) {
+		err = mmc_cmdq_get_qsr(card, &qsr);
+		if (err)
+			goto recover;
+
+		ready = qsr & cmdq->busy;
+		if (!ready) {
+			if (time_after(jiffies, timeout)) {
+				err = -ETIMEDOUT;
+				goto recover;
+			}
+			usleep_range(delay_us, delay_us * 2);
+			delay_us = min(delay_us * 2, MMC_CMDQ_POLL_MAX_US);
+			continue;
+		}
+
+		for_each_set_bit(tag, &ready, cmdq->depth) {
+			err = mmc_blk_cmdq_exec(mq, tag);
+			if (err)
+				goto recover;
+		}
+		tag = -1;
+		timeout = jiffies + msecs_to_jiffies(MMC_CMDQ_TIMEOUT_MS);
+		delay_us = MMC_CMDQ_POLL_MIN_US;
+	}
+
+	cmdq->errors = 0;
+	return 1;
+
+ recover:
+	mmc_blk_cmdq_recover(mq, err, tag);
+	return 0;
+}
+
+/*
+ * Partition dispatcher.  Every physical partition has its own queue and
+ * thread, and a thread keeps the host claimed for a whole burst, so the
+ * partition switch (CMD6 and a drained pipeline) only happens between
+ * bursts.  What is left to do is keep a busy partition from holding the
+ * host forever while batching up the requests of the others: once its
+ * part_slice_ms are used up, a burst gives way to any other partition
+ * waiting for the host, which then drains what queued up meanwhile.
+ */
+static void mmc_blk_part_claim(struct mmc_queue *mq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = mq->card;
+	struct mmc_host *host = card->host;
+	struct mmc_blk_data *main_md = mmc_get_drvdata(card);
+	bool nested = host->claimed && host->claimer == current;
+
+	set_bit(md->part_type, &main_md->part_waiting);
+	if (md->part_yielded) {
+		/* let the partitions we gave way to have their turn first */
+		md->part_yielded = false;
+		wait_event_timeout(host->wq,
+			!(main_md->part_waiting & ~BIT(md->part_type)),
+			msecs_to_jiffies(MMC_BLK_PART_HANDOFF_MS));
+	}
+	mmc_claim_host(host);
+	clear_bit(md->part_type, &main_md->part_waiting);
+
+	if (!nested)
+		main_md->part_slice_start = jiffies;
+}
+
+static bool mmc_blk_part_should_yield(struct mmc_queue *mq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_host *host = mq->card->host;
+	struct mmc_blk_data *main_md = mmc_get_drvdata(mq->card);
+
+	if (!main_md->part_slice_ms || !host->claimed ||
+	    host->claimer != current)
+		return false;
+
+	return (main_md->part_waiting & ~BIT(md->part_type)) &&
+		time_after(jiffies, main_md->part_slice_start +
+			   msecs_to_jiffies(main_md->part_slice_ms));
+}
+
+/*
+ * Hand @req and anything prepared ahead back to the block layer and
+ * finish what is in flight, so the burst ends and the host is released.
+ */
+static void mmc_blk_part_yield(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = mq->card;
+	struct mmc_blk_data *main_md = mmc_get_drvdata(card);
+	struct request_queue *q = mq->queue;
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+
+	mmc_blk_unwind_ahead(mq);
+	if (mqrq->ahead) {
+		mmc_unprep_async_req(card->host, &mqrq->mmc_active);
+		mqrq->ahead = false;
+	}
+	spin_lock_irq(q->queue_lock);
+	blk_requeue_request(q, req);
+	spin_unlock_irq(q->queue_lock);
+	mqrq->brq.mrq.data = NULL;
+	mqrq->req = NULL;
+
+	if (card->ext_csd.cmdq_en)
+		mmc_blk_cmdq_off(mq);
+	if (card->host->areq)
+		mmc_blk_issue_rw_rq(mq, NULL);
+
+	md->part_yielded = true;
+	main_md->part_yields++;
+}
+
 static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 {
 	int ret;
@@ -2754,10 +3710,18 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 	}
 #endif
 
+	if (req && mmc_blk_part_should_yield(mq)) {
+		mmc_blk_part_yield(mq, req);
+		mq->flags &= ~(MMC_QUEUE_NEW_REQUEST | MMC_QUEUE_URGENT_REQUEST);
+		req = NULL;
+		ret = 0;
+		goto out;
+	}
+
 	if (req && !mq->mqrq_prev->req) {
 		mmc_rpm_hold(host, &card->dev);
 		/* claim host only for the first request */
-		mmc_claim_host(card->host);
+		mmc_blk_part_claim(mq);
 		if (card->ext_csd.bkops_en)
 			mmc_stop_bkops(card);
 	}
@@ -2775,6 +3739,9 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 
 	mq->flags &= ~MMC_QUEUE_NEW_REQUEST;
 	mq->flags &= ~MMC_QUEUE_URGENT_REQUEST;
+	/* anything but a queued task, including the end of a burst */
+	if (card->ext_csd.cmdq_en && !mmc_blk_cmdq_able(mq, req))
+		mmc_blk_cmdq_off(mq);
 	if (req && req->cmd_flags & REQ_SANITIZE) {
 		/* complete ongoing async transfer before issuing sanitize */
 		if (card->host && card->host->areq)
@@ -2794,6 +3761,11 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		if (card->host->areq)
 			mmc_blk_issue_rw_rq(mq, NULL);
 		ret = mmc_blk_issue_flush(mq, req);
+	} else if (mmc_blk_cmdq_able(mq, req)) {
+		/* finish a legacy transfer still in flight first */
+		if (host->areq)
+			mmc_blk_issue_rw_rq(mq, NULL);
+		ret = mmc_blk_issue_cmdq_rq(mq, req);
 	} else {
 		if (!req && host->areq) {
 			spin_lock_irqsave(&host->context_info.lock, flags);
@@ -2882,11 +3854,15 @@ static struct mmc_blk_data *mmc_blk_alloc_req(struct mmc_card *card,
 	spin_lock_init(&md->lock);
 	INIT_LIST_HEAD(&md->part);
 	md->usage = 1;
+	md->part_slice_ms = MMC_BLK_PART_SLICE_MS;
 
 	ret = mmc_init_queue(&md->queue, card, &md->lock, subname);
 	if (ret)
 		goto err_putdisk;
 
+	if (area_type & MMC_BLK_DATA_AREA_MAIN)
+		mmc_cmdq_init(&md->queue, card);
+
 	md->queue.issue_fn = mmc_blk_issue_rq;
 	md->queue.data = md;
 
@@ -3038,6 +4014,17 @@ static void mmc_blk_remove_req(struct mmc_blk_data *md)
 		card = md->queue.card;
 		device_remove_file(disk_to_dev(md->disk),
 				   &md->num_wr_reqs_to_start_packing);
+		device_remove_file(disk_to_dev(md->disk), &md->queue_depth);
+		device_remove_file(disk_to_dev(md->disk), &md->packed_limit);
+		device_remove_file(disk_to_dev(md->disk), &md->packed_trigger);
+		device_remove_file(disk_to_dev(md->disk),
+				   &md->urgent_budget_us);
+		device_remove_file(disk_to_dev(md->disk),
+				   &md->urgent_max_intr);
+		device_remove_file(disk_to_dev(md->disk), &md->urgent_stats);
+		device_remove_file(disk_to_dev(md->disk), &md->part_slice);
+		device_remove_file(disk_to_dev(md->disk),
+				   &md->part_switch_stats);
 		if (md->disk->flags & GENHD_FL_UP) {
 			device_remove_file(disk_to_dev(md->disk), &md->force_ro);
 			if ((md->area_type & MMC_BLK_DATA_AREA_BOOT) &&
@@ -3138,8 +4125,96 @@ static int mmc_add_disk(struct mmc_blk_data *md)
 	if (ret)
 		goto no_pack_for_random_fails;
 
+	md->queue_depth.show = queue_depth_show;
+	md->queue_depth.store = queue_depth_store;
+	sysfs_attr_init(&md->queue_depth.attr);
+	md->queue_depth.attr.name = "queue_depth";
+	md->queue_depth.attr.mode = S_IRUGO | S_IWUSR;
+	ret = device_create_file(disk_to_dev(md->disk), &md->queue_depth);
+	if (ret)
+		goto queue_depth_fails;
+
+	md->packed_limit.show = packed_limit_show;
+	md->packed_limit.store = packed_limit_store;
+	sysfs_attr_init(&md->packed_limit.attr);
+	md->packed_limit.attr.name = "packed_limit";
+	md->packed_limit.attr.mode = S_IRUGO | S_IWUSR;
+	ret = device_create_file(disk_to_dev(md->disk), &md->packed_limit);
+	if (ret)
+		goto packed_limit_fails;
+
+	md->packed_trigger.show = packed_trigger_show;
+	sysfs_attr_init(&md->packed_trigger.attr);
+	md->packed_trigger.attr.name = "packed_trigger";
+	md->packed_trigger.attr.mode = S_IRUGO;
+	ret = device_create_file(disk_to_dev(md->disk), &md->packed_trigger);
+	if (ret)
+		goto packed_trigger_fails;
+
+	md->urgent_budget_us.show = urgent_budget_us_show;
+	md->urgent_budget_us.store = urgent_budget_us_store;
+	sysfs_attr_init(&md->urgent_budget_us.attr);
+	md->urgent_budget_us.attr.name = "urgent_budget_us";
+	md->urgent_budget_us.attr.mode = S_IRUGO | S_IWUSR;
+	ret = device_create_file(disk_to_dev(md->disk),
+				 &md->urgent_budget_us);
+	if (ret)
+		goto urgent_budget_us_fails;
+
+	md->urgent_max_intr.show = urgent_max_intr_show;
+	md->urgent_max_intr.store = urgent_max_intr_store;
+	sysfs_attr_init(&md->urgent_max_intr.attr);
+	md->urgent_max_intr.attr.name = "urgent_max_intr";
+	md->urgent_max_intr.attr.mode = S_IRUGO | S_IWUSR;
+	ret = device_create_file(disk_to_dev(md->disk),
+				 &md->urgent_max_intr);
+	if (ret)
+		goto urgent_max_intr_fails;
+
+	md->urgent_stats.show = urgent_stats_show;
+	sysfs_attr_init(&md->urgent_stats.attr);
+	md->urgent_stats.attr.name = "urgent_stats";
+	md->urgent_stats.attr.mode = S_IRUGO;
+	ret = device_create_file(disk_to_dev(md->disk), &md->urgent_stats);
+	if (ret)
+		goto urgent_stats_fails;
+
+	md->part_slice.show = part_slice_ms_show;
+	md->part_slice.store = part_slice_ms_store;
+	sysfs_attr_init(&md->part_slice.attr);
+	md->part_slice.attr.name = "part_slice_ms";
+	md->part_slice.attr.mode = S_IRUGO | S_IWUSR;
+	ret = device_create_file(disk_to_dev(md->disk), &md->part_slice);
+	if (ret)
+		goto part_slice_ms_fails;
+
+	md->part_switch_stats.show = part_switch_stats_show;
+	sysfs_attr_init(&md->part_switch_stats.attr);
+	md->part_switch_stats.attr.name = "part_switch_stats";
+	md->part_switch_stats.attr.mode = S_IRUGO;
+	ret = device_create_file(disk_to_dev(md->disk),
+				 &md->part_switch_stats);
+	if (ret)
+		goto part_switch_stats_fails;
+
 	return ret;
 
+part_switch_stats_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->part_slice);
+part_slice_ms_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->urgent_stats);
+urgent_stats_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->urgent_max_intr);
+urgent_max_intr_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->urgent_budget_us);
+urgent_budget_us_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->packed_trigger);
+packed_trigger_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->packed_limit);
+packed_limit_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->queue_depth);
+queue_depth_fails:
+	device_remove_file(disk_to_dev(md->disk), &md->no_pack_for_random);
 no_pack_for_random_fails:
 	device_remove_file(disk_to_dev(md->disk),
 			   &md->bkops_check_threshold);
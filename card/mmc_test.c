@@ -29,6 +29,8 @@
 #define RESULT_UNSUP_HOST	2
 #define RESULT_UNSUP_CARD	3
 
+#define MMC_TEST_BUSY_TIMEOUT_MS	(10 * 60 * 1000)
+
 #define BUFFER_ORDER		2
 #define BUFFER_SIZE		(PAGE_SIZE << BUFFER_ORDER)
 
@@ -222,10 +224,10 @@ static void mmc_test_prepare_mrq(struct mmc_test_card *test,
 	mmc_set_data_timeout(mrq->data, test->card);
 }
 
-static int mmc_test_busy(struct mmc_command *cmd)
+static int mmc_test_busy_status(u32 status)
 {
-	return !(cmd->resp[0] & R1_READY_FOR_DATA) ||
-		(R1_CURRENT_STATE(cmd->resp[0]) == R1_STATE_PRG);
+	return !(status & R1_READY_FOR_DATA) ||
+		(R1_CURRENT_STATE(status) == R1_STATE_PRG);
 }
 
 /*
@@ -233,31 +235,20 @@ static int mmc_test_busy(struct mmc_command *cmd)
  */
 static int mmc_test_wait_busy(struct mmc_test_card *test)
 {
-	int ret, busy;
-	struct mmc_command cmd = {0};
-
-	busy = 0;
-	do {
-		memset(&cmd, 0, sizeof(struct mmc_command));
-
-		cmd.opcode = MMC_SEND_STATUS;
-		cmd.arg = test->card->rca << 16;
-		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	struct mmc_card *card = test->card;
+	u32 status;
+	int ret;
 
-		ret = mmc_wait_for_cmd(test->card->host, &cmd, 0);
-		if (ret)
-			break;
+	/* a host waiting while busy should leave nothing to poll for */
+	ret = mmc_wait_busy(card, MMC_TEST_BUSY_TIMEOUT_MS, true, &status);
+	if (ret || !mmc_test_busy_status(status))
+		return ret;
 
-		if (!busy && mmc_test_busy(&cmd)) {
-			busy = 1;
-			if (test->card->host->caps & MMC_CAP_WAIT_WHILE_BUSY)
-				pr_info("%s: Warning: Host did not "
-					"wait for busy state to end.\n",
-					mmc_hostname(test->card->host));
-		}
-	} while (mmc_test_busy(&cmd));
+	pr_info("%s: Warning: Host did not "
+		"wait for busy state to end.\n",
+		mmc_hostname(card->host));
 
-	return ret;
+	return mmc_wait_busy(card, MMC_TEST_BUSY_TIMEOUT_MS, false, NULL);
 }
 
 /*
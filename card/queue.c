@@ -15,12 +15,20 @@
 #include <linux/freezer.h>
 #include <linux/kthread.h>
 #include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 
 #include <linux/mmc/card.h>
 #include <linux/mmc/host.h>
+#include <linux/mmc/mem_log.h>
 #include "queue.h"
 
+/*
+ * Bounce buffers start out at MMC_QUEUE_BOUNCESZ_MAX and are halved
+ * until all slots get one, but never below MMC_QUEUE_BOUNCESZ.
+ */
 #define MMC_QUEUE_BOUNCESZ	65536
+#define MMC_QUEUE_BOUNCESZ_MAX	(512 * 1024)
 
 
 /*
@@ -30,6 +38,14 @@
  */
 #define DEFAULT_NUM_REQS_TO_START_PACK 17
 
+/*
+ * Urgent reads stop a running write only if it would otherwise keep them
+ * waiting longer than this, and a write is stopped at most this many
+ * times before it gets to finish.
+ */
+#define DEFAULT_URGENT_BUDGET_US	5000
+#define DEFAULT_URGENT_MAX_INTR		2
+
 /*
  * Prepare a MMC request. This just filters out odd stuff.
  */
@@ -63,15 +79,25 @@ static int mmc_queue_thread(void *d)
 
 	down(&mq->thread_sem);
 	do {
-		struct mmc_queue_req *tmp;
 		struct request *req = NULL;
 
 		spin_lock_irq(q->queue_lock);
 		set_current_state(TASK_INTERRUPTIBLE);
-		req = blk_fetch_request(q);
-		mq->mqrq_cur->req = req;
+		if (mq->nr_ahead) {
+			/* fetched and prepared while the device was busy */
+			req = mq->mqrq_cur->req;
+			mq->nr_ahead--;
+		} else {
+			req = blk_fetch_request(q);
+			mq->mqrq_cur->req = req;
+		}
 		spin_unlock_irq(q->queue_lock);
 
+		if (req && !mq->mqrq_cur->ahead)
+			memlog_block_add(card->host->index, MEMLOG_BLK_FETCH,
+					 blk_rq_pos(req), blk_rq_sectors(req),
+					 rq_data_dir(req), 0);
+
 		if (req || mq->mqrq_prev->req) {
 			set_current_state(TASK_RUNNING);
 			mq->issue_fn(mq, req);
@@ -92,14 +118,13 @@ static int mmc_queue_thread(void *d)
 			}
 
 			/*
-			 * Current request becomes previous request
-			 * and vice versa.
+			 * Current request becomes previous request and
+			 * the next slot, free or prepared ahead, current.
 			 */
 			mq->mqrq_prev->brq.mrq.data = NULL;
 			mq->mqrq_prev->req = NULL;
-			tmp = mq->mqrq_prev;
 			mq->mqrq_prev = mq->mqrq_cur;
-			mq->mqrq_cur = tmp;
+			mq->mqrq_cur = mmc_queue_next_slot(mq, mq->mqrq_cur);
 		} else {
 			if (kthread_should_stop()) {
 				set_current_state(TASK_RUNNING);
@@ -155,6 +180,99 @@ static void mmc_request(struct request_queue *q)
 		wake_up_process(mq->thread);
 }
 
+/*
+ * mmc_queue_may_preempt() - urgent read policy
+ * @mq: MMC queue with an urgent request pending.
+ *
+ * Decides whether the urgent request may stop the running one.  Only
+ * writes are ever stopped (see mmc_should_stop_curr_req()).  A write
+ * that was already interrupted urgent_max_intr times since the last
+ * write completed runs to the end.  Otherwise the write is stopped only
+ * when, judging by the recent write bandwidth, it would keep the read
+ * waiting beyond urgent_budget_us.
+ */
+static bool mmc_queue_may_preempt(struct mmc_queue *mq)
+{
+	struct mmc_queue_req *mqrq = mq->mqrq_prev;
+	struct mmc_request *mrq = &mqrq->brq.mrq;
+	u64 left_us, elapsed_us;
+
+	if (!mqrq->req || rq_data_dir(mqrq->req) != WRITE || !mrq->data ||
+	    !mrq->dispatch_time)
+		return true;
+
+	if (mq->urgent_intr >= mq->urgent_max_intr)
+		return false;
+
+	if (!mq->urgent_budget_us || !mq->wr_bw)
+		return true;
+
+	left_us = div_u64((u64)mrq->data->blocks * mrq->data->blksz * 1000,
+			  mq->wr_bw);
+	elapsed_us = div_u64(sched_clock() - mrq->dispatch_time, 1000);
+
+	return left_us > elapsed_us + mq->urgent_budget_us;
+}
+
+/**
+ * mmc_queue_account_write() - a write completed
+ * @mq: MMC queue.
+ * @mqrq: the completed request.
+ *
+ * Feeds the write bandwidth estimate and lets the next write be
+ * interrupted again.
+ */
+void mmc_queue_account_write(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
+{
+	struct mmc_request *mrq = &mqrq->brq.mrq;
+	u64 ns = mrq->done_time - mrq->dispatch_time;
+	int bw;
+
+	mq->urgent_intr = 0;
+
+	/* small writes say more about command overhead than bandwidth */
+	if (!mrq->dispatch_time || mrq->done_time <= mrq->dispatch_time ||
+	    mqrq->brq.data.bytes_xfered < (64 << 10))
+		return;
+
+	bw = div64_u64((u64)mqrq->brq.data.bytes_xfered * NSEC_PER_MSEC, ns);
+	if (!mq->wr_bw)
+		mq->wr_bw = bw;
+	else
+		mq->wr_bw += (bw - (int)mq->wr_bw) / 8;
+}
+
+/**
+ * mmc_queue_account_preempt() - a write was given back for an urgent one
+ * @mq: MMC queue.
+ * @mqrq: the interrupted request.
+ * @remain: bytes the host had not transferred yet when it was stopped.
+ *
+ * What reached the card but has to be sent again counts as wasted.
+ */
+void mmc_queue_account_preempt(struct mmc_queue *mq,
+			       struct mmc_queue_req *mqrq, int remain)
+{
+	struct mmc_data *data = &mqrq->brq.data;
+	struct request *prq;
+	s64 wasted = (s64)data->blocks * data->blksz - remain;
+	int i = 0;
+
+	/* the packed entries the card reported as programmed are kept */
+	if (mqrq->packed_cmd != MMC_PACKED_NONE) {
+		list_for_each_entry(prq, &mqrq->packed_list, queuelist) {
+			if (i++ == mqrq->packed_fail_idx)
+				break;
+			wasted -= blk_rq_bytes(prq);
+		}
+	}
+
+	mq->urgent_intr++;
+	mq->nr_preempted++;
+	if (wasted > 0)
+		mq->preempt_wasted += wasted;
+}
+
 /*
  * mmc_urgent_request() - Urgent MMC request handler.
  * @q: request queue.
@@ -181,7 +299,8 @@ static void mmc_urgent_request(struct request_queue *q)
 	spin_lock_irqsave(&cntx->lock, flags);
 
 	/* do stop flow only when mmc thread is waiting for done */
-	if (mq->mqrq_cur->req || mq->mqrq_prev->req) {
+	if ((mq->mqrq_cur->req || mq->mqrq_prev->req) &&
+	    mmc_queue_may_preempt(mq)) {
 		/*
 		 * Urgent request must be executed alone
 		 * so disable the write packing
@@ -191,6 +310,8 @@ static void mmc_urgent_request(struct request_queue *q)
 		spin_unlock_irqrestore(&cntx->lock, flags);
 		wake_up_interruptible(&cntx->wait);
 	} else {
+		if (mq->mqrq_prev->req)
+			mq->nr_preempt_denied++;
 		spin_unlock_irqrestore(&cntx->lock, flags);
 		mmc_request(q);
 	}
@@ -237,6 +358,64 @@ static void mmc_queue_setup_sanitize(struct request_queue *q)
 	queue_flag_set_unlocked(QUEUE_FLAG_SANITIZE, q);
 }
 
+static void mmc_cmdq_free(struct mmc_queue *mq)
+{
+	int i;
+
+	if (!mq->cmdq)
+		return;
+
+	for (i = 0; i < mq->cmdq->depth; i++)
+		kfree(mq->cmdq->tasks[i].sg);
+	kfree(mq->cmdq->tasks);
+	kfree(mq->cmdq);
+	mq->cmdq = NULL;
+}
+
+static void mmc_queue_free_slot(struct mmc_queue_req *mqrq)
+{
+	kfree(mqrq->bounce_sg);
+	mqrq->bounce_sg = NULL;
+
+	kfree(mqrq->sg);
+	mqrq->sg = NULL;
+
+	kfree(mqrq->bounce_buf);
+	mqrq->bounce_buf = NULL;
+}
+
+/*
+ * Allocate the scatterlists of one slot, and its bounce buffer when the
+ * queue bounces.  Slots that are already set up are left alone.
+ */
+static int mmc_queue_alloc_slot(struct mmc_queue *mq,
+				struct mmc_queue_req *mqrq)
+{
+	int ret = 0;
+
+	if (mqrq->sg)
+		return 0;
+
+	if (mq->bouncesz) {
+		if (!mqrq->bounce_buf) {
+			mqrq->bounce_buf = kmalloc(mq->bouncesz, GFP_KERNEL);
+			if (!mqrq->bounce_buf)
+				return -ENOMEM;
+		}
+		mqrq->bounce_sg = mmc_alloc_sg(mq->bouncesz / 512, &ret);
+		if (ret)
+			goto err;
+		mqrq->sg = mmc_alloc_sg(1, &ret);
+	} else {
+		mqrq->sg = mmc_alloc_sg(mq->card->host->max_segs, &ret);
+	}
+	if (!ret)
+		return 0;
+err:
+	mmc_queue_free_slot(mqrq);
+	return ret;
+}
+
 /**
  * mmc_init_queue - initialise a queue structure.
  * @mq: mmc queue
@@ -252,8 +431,7 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 	struct mmc_host *host = card->host;
 	u64 limit = BLK_BOUNCE_HIGH;
 	int ret;
-	struct mmc_queue_req *mqrq_cur = &mq->mqrq[0];
-	struct mmc_queue_req *mqrq_prev = &mq->mqrq[1];
+	int i;
 
 	if (mmc_dev(host)->dma_mask && *mmc_dev(host)->dma_mask)
 		limit = *mmc_dev(host)->dma_mask;
@@ -268,18 +446,32 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 			mq->card->ext_csd.hpi_en)
 		blk_urgent_request(mq->queue, mmc_urgent_request);
 
-	memset(&mq->mqrq_cur, 0, sizeof(mq->mqrq_cur));
-	memset(&mq->mqrq_prev, 0, sizeof(mq->mqrq_prev));
-
-	INIT_LIST_HEAD(&mqrq_cur->packed_list);
-	INIT_LIST_HEAD(&mqrq_prev->packed_list);
-
-	mq->mqrq_cur = mqrq_cur;
-	mq->mqrq_prev = mqrq_prev;
+	mq->mqrq = kcalloc(MMC_QUEUE_MAX_DEPTH, sizeof(*mq->mqrq), GFP_KERNEL);
+	if (!mq->mqrq) {
+		ret = -ENOMEM;
+		goto cleanup_queue;
+	}
+	for (i = 0; i < MMC_QUEUE_MAX_DEPTH; i++)
+		INIT_LIST_HEAD(&mq->mqrq[i].packed_list);
+
+	mq->qdepth = clamp(CONFIG_MMC_BLOCK_QUEUE_DEPTH, 2,
+			   MMC_QUEUE_MAX_DEPTH);
+	mq->nr_ahead = 0;
+	mq->bouncesz = 0;
+	mq->bounce_pfn = 0;
+	mq->cmdq = NULL;
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_prev = &mq->mqrq[mq->qdepth - 1];
 	mq->queue->queuedata = mq;
 	mq->num_wr_reqs_to_start_packing =
 		min_t(int, (int)card->ext_csd.max_packed_writes,
 		     DEFAULT_NUM_REQS_TO_START_PACK);
+	/* start out expecting bursts as long as the default trigger */
+	mq->wr_burst_avg =
+		DEFAULT_NUM_REQS_TO_START_PACK << MMC_PACK_EWMA_SHIFT;
+	mq->rd_intr_avg = 0;
+	mq->urgent_budget_us = DEFAULT_URGENT_BUDGET_US;
+	mq->urgent_max_intr = DEFAULT_URGENT_MAX_INTR;
 
 	blk_queue_prep_rq(mq->queue, mmc_prep_request);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, mq->queue);
@@ -295,7 +487,7 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 	if (host->max_segs == 1) {
 		unsigned int bouncesz;
 
-		bouncesz = MMC_QUEUE_BOUNCESZ;
+		bouncesz = MMC_QUEUE_BOUNCESZ_MAX;
 
 		if (bouncesz > host->max_req_size)
 			bouncesz = host->max_req_size;
@@ -304,51 +496,54 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 		if (bouncesz > (host->max_blk_count * 512))
 			bouncesz = host->max_blk_count * 512;
 
-		if (bouncesz > 512) {
-			mqrq_cur->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mqrq_cur->bounce_buf) {
-				pr_warning("%s: unable to "
-					"allocate bounce cur buffer\n",
-					mmc_card_name(card));
+		while (bouncesz > 512) {
+			for (i = 0; i < mq->qdepth; i++) {
+				mq->mqrq[i].bounce_buf = kmalloc(bouncesz,
+						GFP_KERNEL | __GFP_NOWARN);
+				if (!mq->mqrq[i].bounce_buf)
+					break;
 			}
-			mqrq_prev->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mqrq_prev->bounce_buf) {
+			if (i == mq->qdepth) {
+				mq->bouncesz = bouncesz;
+				break;
+			}
+			while (i--) {
+				kfree(mq->mqrq[i].bounce_buf);
+				mq->mqrq[i].bounce_buf = NULL;
+			}
+			if (bouncesz <= MMC_QUEUE_BOUNCESZ) {
 				pr_warning("%s: unable to "
-					"allocate bounce prev buffer\n",
+					"allocate bounce buffers\n",
 					mmc_card_name(card));
-				kfree(mqrq_cur->bounce_buf);
-				mqrq_cur->bounce_buf = NULL;
+				break;
 			}
+			bouncesz = max_t(unsigned int, bouncesz / 2,
+					 MMC_QUEUE_BOUNCESZ);
 		}
 
-		if (mqrq_cur->bounce_buf && mqrq_prev->bounce_buf) {
+		if (mq->bouncesz) {
+			bouncesz = mq->bouncesz;
+			/*
+			 * Single segment requests the host can reach are
+			 * handed over as they are, see mmc_queue_map_sg().
+			 */
+			mq->bounce_pfn = min_t(u64, limit >> PAGE_SHIFT,
+					       blk_max_low_pfn);
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_hw_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mqrq_cur->sg = mmc_alloc_sg(1, &ret);
-			if (ret)
-				goto cleanup_queue;
-
-			mqrq_cur->bounce_sg =
-				mmc_alloc_sg(bouncesz / 512, &ret);
-			if (ret)
-				goto cleanup_queue;
-
-			mqrq_prev->sg = mmc_alloc_sg(1, &ret);
-			if (ret)
-				goto cleanup_queue;
-
-			mqrq_prev->bounce_sg =
-				mmc_alloc_sg(bouncesz / 512, &ret);
-			if (ret)
-				goto cleanup_queue;
+			for (i = 0; i < mq->qdepth; i++) {
+				ret = mmc_queue_alloc_slot(mq, &mq->mqrq[i]);
+				if (ret)
+					goto free_slots;
+			}
 		}
 	}
 #endif
 
-	if (!mqrq_cur->bounce_buf && !mqrq_prev->bounce_buf) {
+	if (!mq->bouncesz) {
 		unsigned int max_segs = host->max_segs;
 
 		blk_queue_bounce_limit(mq->queue, limit);
@@ -358,24 +553,19 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 retry:
 		blk_queue_max_segments(mq->queue, host->max_segs);
 
-		mqrq_cur->sg = mmc_alloc_sg(host->max_segs, &ret);
-		if (ret == -ENOMEM)
-			goto cur_sg_alloc_failed;
-		else if (ret)
-			goto cleanup_queue;
-
-		mqrq_prev->sg = mmc_alloc_sg(host->max_segs, &ret);
-		if (ret == -ENOMEM)
-			goto prev_sg_alloc_failed;
-		else if (ret)
-			goto cleanup_queue;
+		for (i = 0; i < mq->qdepth; i++) {
+			ret = mmc_queue_alloc_slot(mq, &mq->mqrq[i]);
+			if (ret == -ENOMEM)
+				goto sg_alloc_failed;
+			else if (ret)
+				goto free_slots;
+		}
 
 		goto success;
 
-prev_sg_alloc_failed:
-		kfree(mqrq_cur->sg);
-		mqrq_cur->sg = NULL;
-cur_sg_alloc_failed:
+sg_alloc_failed:
+		while (i--)
+			mmc_queue_free_slot(&mq->mqrq[i]);
 		host->max_segs /= 2;
 		if (host->max_segs) {
 			pr_warning("%s: p1-fs allocate max segs =%d\n",
@@ -383,7 +573,7 @@ cur_sg_alloc_failed:
 			goto retry;
 		} else {
 			host->max_segs = max_segs;
-			goto cleanup_queue;
+			goto free_slots;
 		}
 	}
 
@@ -395,27 +585,18 @@ success:
 
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto free_slots;
 	}
 
 	return 0;
- free_bounce_sg:
-	kfree(mqrq_cur->bounce_sg);
-	mqrq_cur->bounce_sg = NULL;
-	kfree(mqrq_prev->bounce_sg);
-	mqrq_prev->bounce_sg = NULL;
-
- cleanup_queue:
-	kfree(mqrq_cur->sg);
-	mqrq_cur->sg = NULL;
-	kfree(mqrq_cur->bounce_buf);
-	mqrq_cur->bounce_buf = NULL;
 
-	kfree(mqrq_prev->sg);
-	mqrq_prev->sg = NULL;
-	kfree(mqrq_prev->bounce_buf);
-	mqrq_prev->bounce_buf = NULL;
+ free_slots:
+	for (i = 0; i < MMC_QUEUE_MAX_DEPTH; i++)
+		mmc_queue_free_slot(&mq->mqrq[i]);
+	kfree(mq->mqrq);
+	mq->mqrq = NULL;
 
+ cleanup_queue:
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -424,8 +605,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 {
 	struct request_queue *q = mq->queue;
 	unsigned long flags;
-	struct mmc_queue_req *mqrq_cur = mq->mqrq_cur;
-	struct mmc_queue_req *mqrq_prev = mq->mqrq_prev;
+	int i;
 
 	/* Make sure the queue isn't suspended, as that will deadlock */
 	mmc_queue_resume(mq);
@@ -439,27 +619,101 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
-	kfree(mqrq_cur->bounce_sg);
-	mqrq_cur->bounce_sg = NULL;
+	for (i = 0; i < MMC_QUEUE_MAX_DEPTH; i++)
+		mmc_queue_free_slot(&mq->mqrq[i]);
+	kfree(mq->mqrq);
+	mq->mqrq = NULL;
+
+	mmc_cmdq_free(mq);
+
+	mq->card = NULL;
+}
+EXPORT_SYMBOL(mmc_cleanup_queue);
 
-	kfree(mqrq_cur->sg);
-	mqrq_cur->sg = NULL;
+/**
+ * mmc_cmdq_init - set up eMMC command queuing for a queue
+ * @mq: MMC queue
+ * @card: card the queue belongs to
+ *
+ * Allocates one task per queue slot the card advertises, each with its
+ * own scatterlist, so a whole burst can be queued before any data moves.
+ * Bouncing queues stay on the legacy path.  Not fatal, the queue simply
+ * works without command queuing when this fails.
+ */
+int mmc_cmdq_init(struct mmc_queue *mq, struct mmc_card *card)
+{
+	struct mmc_cmdq *cmdq;
+	int depth = card->ext_csd.cmdq_depth;
+	int i, ret = 0;
 
-	kfree(mqrq_cur->bounce_buf);
-	mqrq_cur->bounce_buf = NULL;
+	if (!depth || mq->bouncesz)
+		return 0;
 
-	kfree(mqrq_prev->bounce_sg);
-	mqrq_prev->bounce_sg = NULL;
+	cmdq = kzalloc(sizeof(*cmdq), GFP_KERNEL);
+	if (!cmdq)
+		return -ENOMEM;
+	cmdq->tasks = kcalloc(depth, sizeof(*cmdq->tasks), GFP_KERNEL);
+	if (!cmdq->tasks) {
+		kfree(cmdq);
+		return -ENOMEM;
+	}
+	cmdq->depth = depth;
+	mq->cmdq = cmdq;
+
+	for (i = 0; i < depth; i++) {
+		cmdq->tasks[i].sg = mmc_alloc_sg(card->host->max_segs, &ret);
+		if (ret) {
+			pr_warning("%s: no memory for command queue, "
+				"not using it\n", mmc_card_name(card));
+			mmc_cmdq_free(mq);
+			return ret;
+		}
+	}
 
-	kfree(mqrq_prev->sg);
-	mqrq_prev->sg = NULL;
+	return 0;
+}
 
-	kfree(mqrq_prev->bounce_buf);
-	mqrq_prev->bounce_buf = NULL;
+/**
+ * mmc_queue_set_depth - change the number of request slots
+ * @mq: MMC queue
+ * @depth: new number of slots, 2 to MMC_QUEUE_MAX_DEPTH
+ *
+ * With two slots one request is prepared while the other one is on the
+ * bus.  Every slot beyond that lets the queue thread fetch, map and
+ * pre_req() one more request while the device is busy.  The queue is
+ * drained first, slots dropped by shrinking keep their buffers so they
+ * can be reused.
+ */
+int mmc_queue_set_depth(struct mmc_queue *mq, int depth)
+{
+	int i;
+	int ret = 0;
+
+	if (depth < 2 || depth > MMC_QUEUE_MAX_DEPTH)
+		return -EINVAL;
+	if (depth == mq->qdepth)
+		return 0;
+	if (mq->flags & MMC_QUEUE_SUSPENDED)
+		return -EBUSY;
+
+	/* wait for the thread to go idle, all slots are free then */
+	mmc_queue_suspend(mq, 1);
+
+	for (i = mq->qdepth; i < depth; i++) {
+		ret = mmc_queue_alloc_slot(mq, &mq->mqrq[i]);
+		if (ret)
+			break;
+	}
+	if (!ret) {
+		mq->qdepth = depth;
+		mq->nr_ahead = 0;
+		mq->mqrq_cur = &mq->mqrq[0];
+		mq->mqrq_prev = &mq->mqrq[depth - 1];
+	}
 
-	mq->card = NULL;
+	mmc_queue_resume(mq);
+	return ret;
 }
-EXPORT_SYMBOL(mmc_cleanup_queue);
 
 /**
  * mmc_queue_suspend - suspend a MMC request queue
@@ -577,6 +831,20 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 
 	mqrq->bounce_sg_len = sg_len;
 
+	/*
+	 * A request that is one contiguous segment already is what the
+	 * host needs, only scattered requests go through the buffer.  A
+	 * segment may span pages, all of it must be reachable by DMA.
+	 */
+	sg = mqrq->bounce_sg;
+	if (sg_len == 1 && page_to_pfn(sg_page(sg)) +
+	    ((sg->offset + sg->length - 1) >> PAGE_SHIFT) <= mq->bounce_pfn) {
+		sg_set_page(mqrq->sg, sg_page(sg), sg->length, sg->offset);
+		mqrq->bounced = false;
+		return 1;
+	}
+	mqrq->bounced = true;
+
 	buflen = 0;
 	for_each_sg(mqrq->bounce_sg, sg, sg_len, i)
 		buflen += sg->length;
@@ -592,7 +860,7 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
  */
 void mmc_queue_bounce_pre(struct mmc_queue_req *mqrq)
 {
-	if (!mqrq->bounce_buf)
+	if (!mqrq->bounce_buf || !mqrq->bounced)
 		return;
 
 	if (rq_data_dir(mqrq->req) != WRITE)
@@ -608,7 +876,7 @@ void mmc_queue_bounce_pre(struct mmc_queue_req *mqrq)
  */
 void mmc_queue_bounce_post(struct mmc_queue_req *mqrq)
 {
-	if (!mqrq->bounce_buf)
+	if (!mqrq->bounce_buf || !mqrq->bounced)
 		return;
 
 	if (rq_data_dir(mqrq->req) != READ)
@@ -15,6 +15,8 @@ struct mmc_blk_request {
 enum mmc_packed_cmd {
 	MMC_PACKED_NONE = 0,
 	MMC_PACKED_WRITE,
+	MMC_PACKED_READ,
+	MMC_PACKED_MERGED,	/* contiguous, sent as one plain transfer */
 };
 
 struct mmc_queue_req {
@@ -24,14 +26,40 @@ struct mmc_queue_req {
 	char			*bounce_buf;
 	struct scatterlist	*bounce_sg;
 	unsigned int		bounce_sg_len;
+	bool			bounced;	/* data goes through bounce_buf */
 	struct mmc_async_req	mmc_active;
 	struct list_head	packed_list;
 	u32			packed_cmd_hdr[128];
+	struct mmc_blk_request	packed_hdr_brq;	/* header write of packed read */
+	struct scatterlist	packed_hdr_sg;
 	unsigned int		packed_blocks;
 	enum mmc_packed_cmd	packed_cmd;
 	int		packed_retries;
 	int		packed_fail_idx;
 	u8		packed_num;
+	u8		packed_limit;	/* limit in effect when packed */
+	bool		ahead;		/* fetched and prepared ahead of issue */
+};
+
+#define MMC_QUEUE_MAX_DEPTH	8
+
+/* fraction bits of the packing trigger averages */
+#define MMC_PACK_EWMA_SHIFT	8
+
+/* one eMMC command queue task */
+struct mmc_cmdq_task {
+	struct request		*req;
+	struct mmc_blk_request	brq;
+	struct scatterlist	*sg;
+};
+
+struct mmc_cmdq {
+	struct mmc_cmdq_task	*tasks;
+	unsigned long		busy;		/* task ids in use */
+	int			depth;
+	int			nr_queued;
+	int			errors;		/* recoveries since last success */
+	bool			broken;		/* fall back to legacy path */
 };
 
 struct mmc_queue {
@@ -46,13 +74,29 @@ struct mmc_queue {
 	int			(*issue_fn)(struct mmc_queue *, struct request *);
 	void			*data;
 	struct request_queue	*queue;
-	struct mmc_queue_req	mqrq[2];
+	struct mmc_queue_req	*mqrq;		/* MMC_QUEUE_MAX_DEPTH slots */
+	int			qdepth;		/* slots in use, >= 2 */
+	int			nr_ahead;	/* prepared slots after mqrq_cur */
+	unsigned int		bouncesz;
+	unsigned long		bounce_pfn;	/* highest pfn used in place */
+	struct mmc_cmdq		*cmdq;		/* NULL: no command queuing */
 	struct mmc_queue_req	*mqrq_cur;
 	struct mmc_queue_req	*mqrq_prev;
 	bool			wr_packing_enabled;
 	int			num_of_potential_packed_wr_reqs;
 	int			num_wr_reqs_to_start_packing;
+	int			wr_burst_avg;	/* EWMA of write burst length */
+	int			rd_intr_avg;	/* EWMA of bursts cut by reads */
 	bool			no_pack_for_random;
+	unsigned int		packed_limit;	/* 0: card default */
+	/* urgent read policy, see mmc_queue_may_preempt() */
+	unsigned int		urgent_budget_us;
+	unsigned int		urgent_max_intr;
+	unsigned int		urgent_intr;	/* since a write completed */
+	unsigned int		wr_bw;		/* EWMA of write bytes per ms */
+	unsigned long		nr_preempted;
+	unsigned long		nr_preempt_denied;
+	u64			preempt_wasted;	/* bytes sent again */
 	int (*err_check_fn) (struct mmc_card *, struct mmc_async_req *);
 	void (*packed_test_fn) (struct request_queue *, struct mmc_queue_req *);
 };
@@ -62,6 +106,24 @@ extern int mmc_init_queue(struct mmc_queue *, struct mmc_card *, spinlock_t *,
 extern void mmc_cleanup_queue(struct mmc_queue *);
 extern int mmc_queue_suspend(struct mmc_queue *, int);
 extern void mmc_queue_resume(struct mmc_queue *);
+extern int mmc_queue_set_depth(struct mmc_queue *, int);
+extern int mmc_cmdq_init(struct mmc_queue *, struct mmc_card *);
+extern void mmc_queue_account_write(struct mmc_queue *,
+				    struct mmc_queue_req *);
+extern void mmc_queue_account_preempt(struct mmc_queue *,
+				      struct mmc_queue_req *, int);
+
+/*
+ * Slots are used round robin: mqrq_prev is in flight, mqrq_cur is being
+ * issued and the nr_ahead slots after it already hold prepared requests.
+ */
+static inline struct mmc_queue_req *
+mmc_queue_next_slot(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
+{
+	if (++mqrq == mq->mqrq + mq->qdepth)
+		mqrq = mq->mqrq;
+	return mqrq;
+}
 
 extern unsigned int mmc_queue_map_sg(struct mmc_queue *,
 				     struct mmc_queue_req *);
@@ -30,6 +30,8 @@
 #include <linux/pm.h>
 #include <linux/slab.h>
 #include <linux/jiffies.h>
+#include <linux/jump_label.h>
+#include <linux/math64.h>
 
 #include <linux/mmc/card.h>
 #include <linux/mmc/host.h>
@@ -69,11 +71,9 @@ static void mmc_clk_scaling(struct mmc_host *host, bool from_wq);
  * Comment : FMBT porting
  * 2013-11-22, p1-fs@lge.com
  */
-#if defined(CONFIG_FMBT_TRACE_EMMC)
 #include <linux/mmc/mem_log.h>
+#if defined(CONFIG_FMBT_TRACE_EMMC)
 #define eftech_printf(fmt, args...) printk(fmt, ## args)
-unsigned long long glTimeGap2 = 0;
-unsigned long long glTimeGap1 = 0;
 #endif
 
 static struct workqueue_struct *workqueue;
@@ -185,15 +185,118 @@ static inline void mmc_should_fail_request(struct mmc_host *host,
 
 #endif /* CONFIG_FAIL_MMC_REQUEST */
 
-static inline void mmc_update_clk_scaling(struct mmc_host *host)
+static inline void mmc_update_clk_scaling(struct mmc_host *host,
+					  struct mmc_request *mrq)
 {
 	if (host->clk_scaling.enable) {
 		host->clk_scaling.busy_time_us +=
-			ktime_to_us(ktime_sub(ktime_get(),
-					host->clk_scaling.start_busy));
-		host->clk_scaling.start_busy = ktime_get();
+			div_u64(mrq->done_time -
+				host->clk_scaling.start_busy, NSEC_PER_USEC);
+		host->clk_scaling.start_busy = mrq->done_time;
+	}
+}
+
+/*
+ * Per completion work nobody may be looking at: perf profiling and
+ * FMBT tracing.  Users hold a reference on the key while enabled, so
+ * the completion path is a single patched-out branch the rest of the
+ * time.  When enabled it still reads no clock and builds no trace
+ * record, see memlog_emmc_defer(); mmc_done_bench() measures it.
+ */
+static struct static_key mmc_done_trace_key = STATIC_KEY_INIT_FALSE;
+
+void mmc_done_trace_get(void)
+{
+	static_key_slow_inc(&mmc_done_trace_key);
+}
+
+void mmc_done_trace_put(void)
+{
+	static_key_slow_dec(&mmc_done_trace_key);
+}
+
+static noinline void mmc_request_done_trace(struct mmc_host *host,
+					    struct mmc_request *mrq)
+{
+	if (mrq->data) {
+#ifdef CONFIG_MMC_PERF_PROFILING
+		/* the request's own stamps, no clock read in here */
+		if (host->perf_enable && mrq->dispatch_time &&
+		    mrq->done_time > mrq->dispatch_time) {
+			u64 ns = mrq->done_time - mrq->dispatch_time;
+
+			if (mrq->data->flags == MMC_DATA_READ) {
+				host->perf.rbytes_drv +=
+						mrq->data->bytes_xfered;
+				host->perf.rtime_drv =
+					ktime_add_ns(host->perf.rtime_drv, ns);
+			} else {
+				host->perf.wbytes_drv +=
+					mrq->data->bytes_xfered;
+				host->perf.wtime_drv =
+					ktime_add_ns(host->perf.wtime_drv, ns);
+			}
+		}
+#endif
+/*
+ * LGE_CHANGE_S
+ * Comment : FMBT porting
+ * 2013-11-22, p1-fs@lge.com
+ */
+#if defined(CONFIG_FMBT_TRACE_EMMC)
+		/* only staged here, memlog builds the records from a work */
+		if (memlog_host_traced(host->index))
+		{
+			if((lge_packed_cmd_info.packed_cmd_hdr[3] == mrq->cmd->arg) && (mrq->cmd->opcode == 25 ||
+					mrq->cmd->opcode == 18)
+					&& (mrq->data->blocks == lge_packed_cmd_info.packed_blocks) )
+				memlog_emmc_defer(mrq,
+					lge_packed_cmd_info.packed_cmd_hdr,
+					min_t(int, ARRAY_SIZE(
+					lge_packed_cmd_info.packed_cmd_hdr),
+					lge_packed_cmd_info.num_packed * 2 + 2));
+			else
+				memlog_emmc_defer(mrq, NULL, 0);
+		}
+	}
+	else {
+		if (memlog_host_traced(host->index))
+		{
+			if(mrq->cmd->opcode != MMC_SEND_STATUS)
+			{
+				memlog_emmc_defer(mrq, NULL, 0);
+			}
+		}
+#endif
+/* LGE_CHANGE_E */
 	}
 }
+
+/*
+ * Always-on latency histogram, see struct mmc_lat_hist.  Completions on
+ * one host are serialized by the host driver, plain increments will do.
+ */
+static inline void mmc_lat_hist_update(struct mmc_host *host,
+				       struct mmc_request *mrq)
+{
+	struct mmc_data *data = mrq->data;
+	unsigned int bytes;
+	int dir, size, bucket;
+
+	if (!data || data->error || !mrq->dispatch_time ||
+	    mrq->done_time < mrq->dispatch_time)
+		return;
+
+	dir = (data->flags & MMC_DATA_WRITE) ? 1 : 0;
+	bytes = data->blocks * data->blksz;
+	size = bytes ? fls((bytes - 1) >> 12) : 0;
+	size = min(size, MMC_LAT_HIST_SIZES - 1);
+	bucket = fls64((mrq->done_time - mrq->dispatch_time) >> 10);
+	bucket = min(bucket, MMC_LAT_HIST_BUCKETS - 1);
+
+	host->lat_hist.buckets[dir][size][bucket]++;
+}
+
 /**
  *	mmc_request_done - finish processing an MMC request
  *	@host: MMC host which completed request
@@ -205,23 +308,12 @@ static inline void mmc_update_clk_scaling(struct mmc_host *host)
 void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 {
 	struct mmc_command *cmd = mrq->cmd;
-/*
- * LGE_CHANGE_S
- * FMBT porting
- * 2013-11-22, p1-fs@lge.com
- */
-#if defined(CONFIG_FMBT_TRACE_EMMC)
-	unsigned long long currentTime = 0;
-	int i;
-#endif
-/* LGE_CHANGE_E */
-
 	int err = cmd->error;
-#ifdef CONFIG_MMC_PERF_PROFILING
-	ktime_t diff;
-#endif
-	if (host->card)
-		mmc_update_clk_scaling(host);
+
+	mrq->done_time = sched_clock();
+
+	if (host->card && !mrq->synthetic)
+		mmc_update_clk_scaling(host, mrq);
 
 	if (err && cmd->retries && mmc_host_is_spi(host)) {
 		if (cmd->resp[0] & R1_SPI_ILLEGAL_COMMAND)
@@ -236,74 +328,22 @@ void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 		if (mrq->done)
 			mrq->done(mrq);
 	} else {
-		mmc_should_fail_request(host, mrq);
-
-		led_trigger_event(host->led, LED_OFF);
+		/* bench completions leave the card's state alone */
+		if (!mrq->synthetic) {
+			mmc_should_fail_request(host, mrq);
+			mmc_lat_hist_update(host, mrq);
+			led_trigger_event(host->led, LED_OFF);
+		}
 
 		pr_debug("%s: req done (CMD%u): %d: %08x %08x %08x %08x\n",
 			mmc_hostname(host), cmd->opcode, err,
 			cmd->resp[0], cmd->resp[1],
 			cmd->resp[2], cmd->resp[3]);
 
-		if (mrq->data) {
-#ifdef CONFIG_MMC_PERF_PROFILING
-			if (host->perf_enable) {
-				diff = ktime_sub(ktime_get(), host->perf.start);
-				if (mrq->data->flags == MMC_DATA_READ) {
-					host->perf.rbytes_drv +=
-							mrq->data->bytes_xfered;
-					host->perf.rtime_drv =
-						ktime_add(host->perf.rtime_drv,
-							diff);
-				} else {
-					host->perf.wbytes_drv +=
-						mrq->data->bytes_xfered;
-					host->perf.wtime_drv =
-						ktime_add(host->perf.wtime_drv,
-							diff);
-				}
-			}
-#endif
+		if (mrq->data)
 			pr_debug("%s:     %d bytes transferred: %d\n",
 				mmc_hostname(host),
 				mrq->data->bytes_xfered, mrq->data->error);
-/*
- * LGE_CHANGE_S
- * Comment : FMBT porting
- * 2013-11-22, p1-fs@lge.com
- */
-#if defined(CONFIG_FMBT_TRACE_EMMC)
-			if(!strncmp(mmc_hostname(host), "mmc0",4))
-			{
-				currentTime = sched_clock();
-				memlog_emmc_add(mrq, currentTime, currentTime - glTimeGap2);
-
-				if((lge_packed_cmd_info.packed_cmd_hdr[3] == mrq->cmd->arg) && (mrq->cmd->opcode == 25)
-						&& (mrq->data->blocks == lge_packed_cmd_info.packed_blocks) )
-				{
-					memlog_packed_add(lge_packed_cmd_info.packed_cmd_hdr[0],0);
-					for(i=2; i<(lge_packed_cmd_info.num_packed*2+1); i=i+2)
-					{
-						memlog_packed_add(lge_packed_cmd_info.packed_cmd_hdr[i],1);
-						memlog_packed_add(lge_packed_cmd_info.packed_cmd_hdr[i+1],2);
-					}
-				}
-			}
-		}
-		else {
-			if(!strncmp(mmc_hostname(host), "mmc0",4))
-			{
-				if(mrq->cmd->opcode != MMC_SEND_STATUS)
-				{
-					currentTime = sched_clock();
-					memlog_emmc_add(mrq, currentTime, currentTime - glTimeGap1);
-				}
-			}
-#endif
-/* LGE_CHANGE_E */
-		}
-
-/* LGE_CHANGE_E */
 
 		if (mrq->stop) {
 			pr_debug("%s:     (CMD%u): %d: %08x %08x %08x %08x\n",
@@ -313,6 +353,10 @@ void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 				mrq->stop->resp[2], mrq->stop->resp[3]);
 		}
 
+		/* the request belongs to its owner once done() ran */
+		if (static_key_false(&mmc_done_trace_key))
+			mmc_request_done_trace(host, mrq);
+
 		if (mrq->done)
 			mrq->done(mrq);
 
@@ -322,6 +366,84 @@ void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 
 EXPORT_SYMBOL(mmc_request_done);
 
+static void mmc_done_bench_done(struct mmc_request *mrq)
+{
+}
+
+static u64 mmc_done_bench_run(struct mmc_host *host, unsigned int n)
+{
+	struct mmc_command cmd = {0};
+	struct mmc_data data = {0};
+	struct mmc_request mrq = {NULL};
+	unsigned long flags;
+	unsigned int i;
+	u64 t, ns = 0;
+
+	cmd.opcode = MMC_READ_MULTIPLE_BLOCK;
+	data.blksz = 512;
+	data.blocks = 8;
+	data.flags = MMC_DATA_READ;
+	mrq.cmd = &cmd;
+	mrq.data = &data;
+	mrq.done = mmc_done_bench_done;
+	mrq.host = host;
+	mrq.synthetic = true;
+
+	for (i = 0; i < n; i++) {
+		cmd.error = 0;
+		data.error = 0;
+		data.bytes_xfered = data.blksz * data.blocks;
+		/* no dispatch time keeps it out of perf */
+		mrq.dispatch_time = 0;
+
+		mmc_host_clk_hold(host);
+		local_irq_save(flags);
+		t = sched_clock();
+		mmc_request_done(host, &mrq);
+		ns += sched_clock() - t;
+		local_irq_restore(flags);
+
+		/* let memlog's drain work keep up, as it would between irqs */
+		if ((i & 15) == 15)
+			msleep(1);
+	}
+	return div_u64(ns, n);
+}
+
+/**
+ *	mmc_done_bench - cost of one mmc_request_done()
+ *	@host: MMC host, claimed by the caller
+ *	@n: completions per pass
+ *
+ *	Completes @n synthetic 4K reads that never reached the host, with
+ *	the trace hook off (unless perf or memlog already hold it) and
+ *	then on, and logs the average ns per completion of both passes.
+ *	The reads are marked synthetic: clock scaling, fault injection,
+ *	the LED and the latency histogram skip them, and memlog stages
+ *	them like real ones but drops them before building records.
+ */
+void mmc_done_bench(struct mmc_host *host, unsigned int n)
+{
+	bool was_on = static_key_enabled(&mmc_done_trace_key);
+	u64 off = 0, on;
+
+	if (!n)
+		return;
+
+	if (!was_on)
+		off = mmc_done_bench_run(host, n);
+	mmc_done_trace_get();
+	on = mmc_done_bench_run(host, n);
+	mmc_done_trace_put();
+
+	if (was_on)
+		pr_info("%s: %u completions, trace hook on: %llu ns each "
+			"(already on, no off pass)\n", mmc_hostname(host), n, on);
+	else
+		pr_info("%s: %u completions, trace hook off: %llu ns, "
+			"on: %llu ns each\n", mmc_hostname(host), n, off, on);
+}
+
 static void
 mmc_start_request(struct mmc_host *host, struct mmc_request *mrq)
 {
@@ -380,25 +502,6 @@ mmc_start_request(struct mmc_host *host, struct mmc_request *mrq)
 			mrq->stop->error = 0;
 			mrq->stop->mrq = mrq;
 		}
-#ifdef CONFIG_MMC_PERF_PROFILING
-		if (host->perf_enable)
-			host->perf.start = ktime_get();
-#endif
-/* 
- * LGE_CHANGE_S
- * Comment : FMBT porting
- * 2013-11-22, p1-fs@lge.com
- */
-#if defined(CONFIG_FMBT_TRACE_EMMC)
-		glTimeGap2 = sched_clock();
-
-	}
-	else
-	{
-		glTimeGap1 = sched_clock();
-#endif
-/* LGE_CHANGE_E */
-	
 	}
 	mmc_host_clk_hold(host);
 	led_trigger_event(host->led, LED_FULL);
@@ -412,9 +515,12 @@ mmc_start_request(struct mmc_host *host, struct mmc_request *mrq)
 		 * releases host.
 		 */
 		mmc_clk_scaling(host, false);
-		host->clk_scaling.start_busy = ktime_get();
 	}
 
+	mrq->dispatch_time = sched_clock();
+	host->clk_scaling.start_busy = mrq->dispatch_time;
+	if (!mrq->issue_time)
+		mrq->issue_time = mrq->dispatch_time;
 	host->ops->request(host, mrq);
 }
 
@@ -569,6 +675,8 @@ void mmc_start_bkops(struct mmc_card *card, bool from_exception)
 	mmc_card_clr_need_bkops(card);
 
 	mmc_card_set_doing_bkops(card);
+	memlog_block_add(card->host->index, MEMLOG_BLK_BKOPS_START, 0, 0,
+			 card->ext_csd.raw_bkops_status, 0);
 out:
 	mmc_release_host(card->host);
 	mmc_rpm_release(card->host, &card->dev);
@@ -623,6 +731,9 @@ static void mmc_wait_done(struct mmc_request *mrq)
  */
 static int __mmc_start_data_req(struct mmc_host *host, struct mmc_request *mrq)
 {
+	struct mmc_request *pre = mrq->pre_mrq;
+	int err;
+
 	mrq->done = mmc_wait_data_done;
 	mrq->host = host;
 	if (mmc_card_removed(host->card)) {
@@ -630,6 +741,25 @@ static int __mmc_start_data_req(struct mmc_host *host, struct mmc_request *mrq)
 		mmc_wait_data_done(mrq);
 		return -ENOMEDIUM;
 	}
+
+	/*
+	 * Some requests need a setup transfer right before them, such as
+	 * the header write of a packed read.  It has to wait until the
+	 * previous async request is done, so it is sent from here.
+	 */
+	if (pre) {
+		mmc_wait_for_req(host, pre);
+		err = pre->cmd->error;
+		if (!err && pre->sbc)
+			err = pre->sbc->error;
+		if (!err && pre->data)
+			err = pre->data->error;
+		if (err) {
+			mrq->cmd->error = err;
+			mmc_wait_data_done(mrq);
+			return err;
+		}
+	}
 	mmc_start_request(host, mrq);
 
 	return 0;
@@ -637,6 +767,8 @@ static int __mmc_start_data_req(struct mmc_host *host, struct mmc_request *mrq)
 
 static int __mmc_start_req(struct mmc_host *host, struct mmc_request *mrq)
 {
+	if (!mrq->issue_time)
+		mrq->issue_time = sched_clock();
 	init_completion(&mrq->completion);
 	mrq->done = mmc_wait_done;
 	if (mmc_card_removed(host->card)) {
@@ -667,6 +799,8 @@ static bool mmc_should_stop_curr_req(struct mmc_host *host)
 
 	remainder = (host->ops->get_xfer_remain) ?
 		host->ops->get_xfer_remain(host) : -1;
+	if (remainder > 0)
+		host->context_info.stop_remain = remainder;
 	return (remainder > 0);
 }
 
@@ -750,6 +884,7 @@ static int mmc_wait_for_data_req_done(struct mmc_host *host,
 	int err;
 	unsigned long flags;
 
+	context_info->stop_remain = 0;
 	while (1) {
 		wait_io_event_interruptible(context_info->wait,
 				(context_info->is_done_rcv ||
@@ -861,13 +996,83 @@ static int mmc_wait_for_data_req_done(struct mmc_host *host,
 	return err;
 }
 
+/*
+ * For commands without data and single block reads the irq, tasklet and
+ * wakeup often take longer than the command.  Spin on the host for a
+ * while first when the opcode usually completes within the budget.
+ */
+static void mmc_poll_for_req(struct mmc_host *host, struct mmc_request *mrq)
+{
+	struct mmc_poll *poll = &host->poll;
+	u32 op = mrq->cmd->opcode;
+	u64 start, budget;
+
+	if (!host->ops->poll_request || !poll->max_ns ||
+	    op >= MMC_POLL_OPCODES)
+		return;
+	if (mrq->data && (mrq->data->blocks > 1 ||
+			  (mrq->data->flags & MMC_DATA_WRITE)))
+		return;
+
+	if (test_bit(op, poll->nopoll)) {
+		poll->skips[op]++;
+		return;
+	}
+
+	/* nothing learned yet: try the whole budget once, not per retry */
+	if (poll->lat_ns[op])
+		budget = 2ULL * poll->lat_ns[op];
+	else if (!test_and_set_bit(op, poll->tried))
+		budget = poll->max_ns;
+	else
+		budget = 0;
+	if (!budget || budget > poll->max_ns) {
+		poll->skips[op]++;
+		return;
+	}
+
+	start = sched_clock();
+	do {
+		if (host->ops->poll_request(host, mrq) < 0) {
+			set_bit(op, poll->nopoll);
+			poll->skips[op]++;
+			return;
+		}
+		if (completion_done(&mrq->completion)) {
+			poll->hits[op]++;
+			return;
+		}
+		cpu_relax();
+	} while (sched_clock() - start < budget);
+
+	poll->misses[op]++;
+}
+
+/* polled or not, every completion teaches the average, weight 1/8 */
+static void mmc_poll_update_lat(struct mmc_host *host,
+				struct mmc_request *mrq)
+{
+	u32 op = mrq->cmd->opcode;
+	s64 lat, avg;
+
+	if (op >= MMC_POLL_OPCODES || !mrq->dispatch_time ||
+	    mrq->done_time < mrq->dispatch_time)
+		return;
+
+	lat = min_t(u64, mrq->done_time - mrq->dispatch_time, U32_MAX);
+	avg = host->poll.lat_ns[op];
+	host->poll.lat_ns[op] = avg ? avg + ((lat - avg) >> 3) : lat;
+}
+
 static void mmc_wait_for_req_done(struct mmc_host *host,
 				  struct mmc_request *mrq)
 {
 	struct mmc_command *cmd;
 
 	while (1) {
+		mmc_poll_for_req(host, mrq);
 		wait_for_completion_io(&mrq->completion);
+		mmc_poll_update_lat(host, mrq);
 
 		cmd = mrq->cmd;
 
@@ -932,6 +1137,43 @@ static void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq,
 	}
 }
 
+/**
+ *	mmc_prep_async_req - prepare a request ahead of mmc_start_req()
+ *	@host: MMC host the request will be started on
+ *	@areq: async request to prepare
+ *
+ *	Runs the host pre_req() for a request that is queued behind the
+ *	one about to be started, so its DMA mapping and cache maintenance
+ *	overlap the transfer in flight. Only done on hosts that can keep
+ *	more than one request prepared; mmc_start_req() then skips its own
+ *	pre_req() for @areq. Undo with mmc_unprep_async_req() if the
+ *	request is not started after all.
+ */
+void mmc_prep_async_req(struct mmc_host *host, struct mmc_async_req *areq)
+{
+	if (!(host->caps2 & MMC_CAP2_MULTI_PRE_REQ) || areq->prepared)
+		return;
+
+	mmc_pre_req(host, areq->mrq, false);
+	areq->prepared = true;
+}
+EXPORT_SYMBOL(mmc_prep_async_req);
+
+/**
+ *	mmc_unprep_async_req - cancel mmc_prep_async_req()
+ *	@host: MMC host the request was prepared for
+ *	@areq: async request that will not be started
+ */
+void mmc_unprep_async_req(struct mmc_host *host, struct mmc_async_req *areq)
+{
+	if (!areq->prepared)
+		return;
+
+	mmc_post_req(host, areq->mrq, -EINVAL);
+	areq->prepared = false;
+}
+EXPORT_SYMBOL(mmc_unprep_async_req);
+
 /**
  *	mmc_start_req - start a non-blocking request
  *	@host: MMC host to start command
@@ -959,11 +1201,17 @@ struct mmc_async_req *mmc_start_req(struct mmc_host *host,
 
 	/* Prepare a new request */
 	if (areq) {
+		/* queue time runs from here, through pre_req and the wait */
+		if (!areq->mrq->issue_time)
+			areq->mrq->issue_time = sched_clock();
 		/*
 		 * start waiting here for possible interrupt
 		 * because mmc_pre_req() taking long time
 		 */
-		mmc_pre_req(host, areq->mrq, !host->areq);
+		if (areq->prepared)
+			areq->prepared = false;
+		else
+			mmc_pre_req(host, areq->mrq, !host->areq);
 	}
 
 	if (host->areq) {
@@ -1203,6 +1451,67 @@ int mmc_wait_for_cmd(struct mmc_host *host, struct mmc_command *cmd, int retries
 
 EXPORT_SYMBOL(mmc_wait_for_cmd);
 
+/**
+ *	mmc_get_cmd_buf - get a buffer for the data of an internal command
+ *	@host: MMC host the command is for
+ *	@len: bytes needed
+ *
+ *	Status, ext_csd, switch and bus test data is small and only moved
+ *	with the host claimed, so each host keeps a few DMA-safe buffers
+ *	for it and these commands don't allocate.  When the caller hasn't
+ *	claimed the host, all buffers are taken or @len is too large, the
+ *	buffer is kmalloc()ed.  Either way, release it with
+ *	mmc_put_cmd_buf() before releasing the host.
+ */
+void *mmc_get_cmd_buf(struct mmc_host *host, unsigned int len)
+{
+	int i;
+
+	if (host->cmd_buf && len <= MMC_CMD_BUF_SIZE &&
+	    host->claimed && host->claimer == current) {
+		for (i = 0; i < MMC_CMD_BUFS; i++) {
+			if (!test_bit(i, &host->cmd_buf_used)) {
+				__set_bit(i, &host->cmd_buf_used);
+				return host->cmd_buf + i * MMC_CMD_BUF_SIZE;
+			}
+		}
+	}
+
+	return kmalloc(len, GFP_KERNEL);
+}
+EXPORT_SYMBOL(mmc_get_cmd_buf);
+
+/**
+ *	mmc_is_cmd_buf - tell if a buffer came from the host's own
+ *	@host: MMC host
+ *	@buf: buffer to check
+ *
+ *	Those are DMA-safe, commands can use them without bouncing.
+ */
+bool mmc_is_cmd_buf(struct mmc_host *host, const void *buf)
+{
+	const u8 *p = buf;
+
+	return host->cmd_buf && p >= host->cmd_buf &&
+		p < host->cmd_buf + MMC_CMD_BUFS * MMC_CMD_BUF_SIZE;
+}
+EXPORT_SYMBOL(mmc_is_cmd_buf);
+
+/**
+ *	mmc_put_cmd_buf - release a buffer from mmc_get_cmd_buf()
+ *	@host: MMC host it was taken from
+ *	@buf: the buffer, may be NULL
+ */
+void mmc_put_cmd_buf(struct mmc_host *host, void *buf)
+{
+	if (mmc_is_cmd_buf(host, buf))
+		__clear_bit(((u8 *)buf - host->cmd_buf) / MMC_CMD_BUF_SIZE,
+			    &host->cmd_buf_used);
+	else
+		kfree(buf);
+}
+EXPORT_SYMBOL(mmc_put_cmd_buf);
+
 /**
  *	mmc_stop_bkops - stop ongoing BKOPS
  *	@card: MMC card to check BKOPS
@@ -1251,6 +1560,8 @@ int mmc_stop_bkops(struct mmc_card *card)
 		mmc_card_clr_doing_bkops(card);
 		err = 0;
 	}
+	memlog_block_add(card->host->index, MEMLOG_BLK_BKOPS_STOP, 0, 0,
+			 err ? 1 : 0, 0);
 
 	MMC_UPDATE_BKOPS_STATS_HPI(card->bkops_info.bkops_stats);
 
@@ -1261,18 +1572,8 @@ EXPORT_SYMBOL(mmc_stop_bkops);
 
 int mmc_read_bkops_status(struct mmc_card *card)
 {
-	int err;
-	u8 *ext_csd;
-
-	/*
-	 * In future work, we should consider storing the entire ext_csd.
-	 */
-	ext_csd = kmalloc(512, GFP_KERNEL);
-	if (!ext_csd) {
-		pr_err("%s: could not allocate buffer to receive the ext_csd.\n",
-		       mmc_hostname(card->host));
-		return -ENOMEM;
-	}
+	const u8 *ext_csd;
+	int err = 0;
 
 	if (card->bkops_info.bkops_stats.ignore_card_bkops_status) {
 		pr_debug("%s: skipping read raw_bkops_status in unittest mode",
@@ -1280,16 +1581,23 @@ int mmc_read_bkops_status(struct mmc_card *card)
 		return 0;
 	}
 
+	/*
+	 * Callers ask because the BKOPS need may have just changed, after
+	 * an exception bit or while idle, so a cached copy can't answer:
+	 * force a read.  The fresh copy still serves later readers.
+	 */
 	mmc_claim_host(card->host);
-	err = mmc_send_ext_csd(card, ext_csd);
+	mmc_ext_csd_invalidate(card);
+	ext_csd = mmc_get_ext_csd_cached(card, EXT_CSD_EXP_EVENTS_STATUS,
+				EXT_CSD_BKOPS_STATUS - EXT_CSD_EXP_EVENTS_STATUS + 1);
+	if (IS_ERR(ext_csd)) {
+		err = PTR_ERR(ext_csd);
+	} else {
+		card->ext_csd.raw_bkops_status = ext_csd[EXT_CSD_BKOPS_STATUS];
+		card->ext_csd.raw_exception_status =
+			ext_csd[EXT_CSD_EXP_EVENTS_STATUS];
+	}
 	mmc_release_host(card->host);
-	if (err)
-		goto out;
-
-	card->ext_csd.raw_bkops_status = ext_csd[EXT_CSD_BKOPS_STATUS];
-	card->ext_csd.raw_exception_status = ext_csd[EXT_CSD_EXP_EVENTS_STATUS];
-out:
-	kfree(ext_csd);
 	return err;
 }
 EXPORT_SYMBOL(mmc_read_bkops_status);
@@ -2391,7 +2699,7 @@ static int mmc_do_erase(struct mmc_card *card, unsigned int from,
 {
 	struct mmc_command cmd = {0};
 	unsigned int qty = 0;
-	unsigned long timeout;
+	u32 status = 0;
 	int err;
 
 	/*
@@ -2469,33 +2777,16 @@ static int mmc_do_erase(struct mmc_card *card, unsigned int from,
 	if (mmc_host_is_spi(card->host))
 		goto out;
 
-	timeout = jiffies + msecs_to_jiffies(MMC_CORE_TIMEOUT_MS);
-	do {
-		memset(&cmd, 0, sizeof(struct mmc_command));
-		cmd.opcode = MMC_SEND_STATUS;
-		cmd.arg = card->rca << 16;
-		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-		/* Do not retry else we can't see errors */
-		err = mmc_wait_for_cmd(card->host, &cmd, 0);
-		if (err || (cmd.resp[0] & 0xFDF92000)) {
-			pr_err("error %d requesting status %#x\n",
-				err, cmd.resp[0]);
-			err = -EIO;
-			goto out;
-		}
-
-		/* Timeout if the device never becomes ready for data and
-		 * never leaves the program state.
-		 */
-		if (time_after(jiffies, timeout)) {
-			pr_err("%s: Card stuck in programming state! %s\n",
-				mmc_hostname(card->host), __func__);
-			err =  -EIO;
-			goto out;
-		}
-
-	} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-		 (R1_CURRENT_STATE(cmd.resp[0]) == R1_STATE_PRG));
+	err = mmc_wait_busy(card, MMC_CORE_TIMEOUT_MS, true, &status);
+	if (err == -ETIMEDOUT) {
+		err = -EIO;
+		goto out;
+	}
+	if (err || (status & 0xFDF92000)) {
+		pr_err("error %d requesting status %#x\n", err, status);
+		err = -EIO;
+		goto out;
+	}
 out:
 	return err;
 }
@@ -2985,6 +3276,13 @@ static bool mmc_is_vaild_state_for_clk_scaling(struct mmc_host *host)
 			card->part_curr == EXT_CSD_PART_CONFIG_ACC_RPMB))
 		goto out;
 
+	/*
+	 * Neither CMD6 nor tuning may be sent while command queue tasks
+	 * are pending, scale once the queue has drained.
+	 */
+	if (card->ext_csd.cmdq_tasks)
+		goto out;
+
 	if (mmc_send_status(card, &status)) {
 		pr_err("%s: Get card status fail\n", mmc_hostname(card->host));
 		goto out;
@@ -3019,9 +3317,11 @@ static int mmc_clk_update_freq(struct mmc_host *host,
 		}
 
 		err = host->bus_ops->change_bus_speed(host, &freq);
-		if (!err)
+		if (!err) {
 			host->clk_scaling.curr_freq = freq;
-		else
+			memlog_block_add(host->index, MEMLOG_BLK_CLK_SCALE,
+					 freq / 1000, 0, state, 0);
+		} else
 			pr_err("%s: %s: failed (%d) at freq=%lu\n",
 				mmc_hostname(host), __func__, err, freq);
 	}
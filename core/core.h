@@ -93,4 +93,7 @@ extern void mmc_exit_clk_scaling(struct mmc_host *host);
 extern void mmc_reset_clk_scale_stats(struct mmc_host *host);
 extern unsigned long mmc_get_max_frequency(struct mmc_host *host);
 void mmc_init_context_info(struct mmc_host *host);
+void mmc_done_trace_get(void);
+void mmc_done_trace_put(void);
+void mmc_done_bench(struct mmc_host *host, unsigned int n);
 #endif
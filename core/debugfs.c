@@ -16,6 +16,7 @@
 #include <linux/stat.h>
 #include <linux/fault-inject.h>
 #include <linux/printk.h>
+#include <linux/math64.h>
 
 #include <linux/scatterlist.h>
 #include <linux/mmc/core.h>
@@ -36,6 +37,8 @@
 #define BUFFER_ORDER		2
 #define BUFFER_SIZE		(PAGE_SIZE << BUFFER_ORDER)
 
+#define MMC_WEAROUT_BUSY_TIMEOUT_MS	(10 * 60 * 1000)
+
 #define MMC_SET_HYNIX_SPICIFIC_CMD     60   /* ac   [31:16] RCA        R1  */	
 #define MMC_SET_HYNIX_ARG_FIRST     0x534D4900
 #define MMC_SET_HYNIX_ARG_SECOND    0x48525054
@@ -252,6 +255,172 @@ out:
 DEFINE_SIMPLE_ATTRIBUTE(mmc_max_clock_fops, mmc_max_clock_get,
 		mmc_max_clock_set, "%llu\n");
 
+/* upper bound of a latency histogram bucket, in us */
+static u64 mmc_lat_hist_bound_us(int bucket)
+{
+	return div_u64(1ULL << (bucket + 10), 1000);
+}
+
+/* smallest bucket holding at least permille of the samples */
+static int mmc_lat_hist_pct(u64 *buckets, u64 total, unsigned int permille)
+{
+	u64 want = div_u64(total * permille + 999, 1000);
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < MMC_LAT_HIST_BUCKETS; i++) {
+		sum += buckets[i];
+		if (sum >= want)
+			break;
+	}
+	return min(i, MMC_LAT_HIST_BUCKETS - 1);
+}
+
+static int mmc_lat_hist_show(struct seq_file *s, void *data)
+{
+	static const char * const dirs[] = { "read", "write" };
+	static const char * const sizes[] = {
+		"<=4K", "<=8K", "<=16K", "<=32K", "<=64K", "<=128K", ">128K",
+	};
+	struct mmc_host *host = s->private;
+	u64 buckets[MMC_LAT_HIST_BUCKETS];
+	u64 total;
+	int dir, size, i;
+
+	seq_printf(s, "%-5s %-6s %10s %10s %10s %10s\n", "dir", "size",
+		   "count", "p50(us)", "p99(us)", "p99.9(us)");
+
+	for (dir = 0; dir < MMC_LAT_HIST_DIRS; dir++) {
+		for (size = 0; size < MMC_LAT_HIST_SIZES; size++) {
+			/* snapshot, the completion path keeps counting */
+			memcpy(buckets, host->lat_hist.buckets[dir][size],
+			       sizeof(buckets));
+			total = 0;
+			for (i = 0; i < MMC_LAT_HIST_BUCKETS; i++)
+				total += buckets[i];
+			if (!total)
+				continue;
+
+			seq_printf(s, "%-5s %-6s %10llu %10llu %10llu %10llu\n",
+				dirs[dir], sizes[size], total,
+				mmc_lat_hist_bound_us(
+					mmc_lat_hist_pct(buckets, total, 500)),
+				mmc_lat_hist_bound_us(
+					mmc_lat_hist_pct(buckets, total, 990)),
+				mmc_lat_hist_bound_us(
+					mmc_lat_hist_pct(buckets, total, 999)));
+			seq_puts(s, "     buckets:");
+			for (i = 0; i < MMC_LAT_HIST_BUCKETS; i++)
+				seq_printf(s, " %llu", buckets[i]);
+			seq_puts(s, "\n");
+		}
+	}
+
+	return 0;
+}
+
+static int mmc_lat_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_lat_hist_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t mmc_lat_hist_write(struct file *file, const char __user *ubuf,
+				  size_t cnt, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_host *host = s->private;
+
+	memset(&host->lat_hist, 0, sizeof(host->lat_hist));
+	return cnt;
+}
+
+static const struct file_operations mmc_lat_hist_fops = {
+	.open		= mmc_lat_hist_open,
+	.read		= seq_read,
+	.write		= mmc_lat_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc_poll_show(struct seq_file *s, void *data)
+{
+	struct mmc_host *host = s->private;
+	struct mmc_poll *poll = &host->poll;
+	int op;
+
+	seq_printf(s, "max_ns %u%s\n", poll->max_ns,
+		   host->ops->poll_request ? "" : " (not supported by host)");
+	seq_printf(s, "%-6s %10s %10s %10s %10s\n", "opcode", "avg(ns)",
+		   "hits", "misses", "skips");
+	for (op = 0; op < MMC_POLL_OPCODES; op++) {
+		if (!poll->lat_ns[op])
+			continue;
+		seq_printf(s, "CMD%-3d %10u %10lu %10lu %10lu%s\n", op,
+			   poll->lat_ns[op], poll->hits[op],
+			   poll->misses[op], poll->skips[op],
+			   test_bit(op, poll->nopoll) ? " (host can't poll)" : "");
+	}
+
+	return 0;
+}
+
+static int mmc_poll_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_poll_show, inode->i_private);
+}
+
+/* sets the spin cap in ns, 0 turns polling off; counters and what was
+ * learned about the host's polling are cleared */
+static ssize_t mmc_poll_write(struct file *file, const char __user *ubuf,
+			      size_t cnt, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_host *host = s->private;
+	unsigned int max_ns;
+	int ret;
+
+	ret = kstrtouint_from_user(ubuf, cnt, 0, &max_ns);
+	if (ret)
+		return ret;
+
+	host->poll.max_ns = max_ns;
+	memset(host->poll.hits, 0, sizeof(host->poll.hits));
+	memset(host->poll.misses, 0, sizeof(host->poll.misses));
+	memset(host->poll.skips, 0, sizeof(host->poll.skips));
+	bitmap_zero(host->poll.tried, MMC_POLL_OPCODES);
+	bitmap_zero(host->poll.nopoll, MMC_POLL_OPCODES);
+	return cnt;
+}
+
+static const struct file_operations mmc_poll_fops = {
+	.open		= mmc_poll_open,
+	.read		= seq_read,
+	.write		= mmc_poll_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* runs mmc_done_bench() with that many completions, results in dmesg */
+static int mmc_done_bench_set(void *data, u64 val)
+{
+	struct mmc_host *host = data;
+
+	if (val > 1000000)
+		return -EINVAL;
+
+	mmc_rpm_hold(host, &host->class_dev);
+	mmc_claim_host(host);
+	mmc_done_bench(host, val);
+	mmc_release_host(host);
+	mmc_rpm_release(host, &host->class_dev);
+
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(mmc_done_bench_fops, NULL, mmc_done_bench_set,
+	"%llu\n");
+
 void mmc_add_host_debugfs(struct mmc_host *host)
 {
 	struct dentry *root;
@@ -278,6 +447,18 @@ void mmc_add_host_debugfs(struct mmc_host *host)
 		&mmc_max_clock_fops))
 		goto err_node;
 
+	if (!debugfs_create_file("latency_hist", S_IRUSR | S_IWUSR, root, host,
+		&mmc_lat_hist_fops))
+		goto err_node;
+
+	if (!debugfs_create_file("poll", S_IRUSR | S_IWUSR, root, host,
+		&mmc_poll_fops))
+		goto err_node;
+
+	if (!debugfs_create_file("done_bench", S_IWUSR, root, host,
+		&mmc_done_bench_fops))
+		goto err_node;
+
 #ifdef CONFIG_MMC_CLKGATE
 	if (!debugfs_create_u32("clk_delay", (S_IRUSR | S_IWUSR),
 				root, &host->clk_delay))
@@ -834,6 +1015,7 @@ static ssize_t mmc_wr_pack_stats_read(struct file *filp, char __user *ubuf,
 {
 	struct mmc_card *card = filp->private_data;
 	struct mmc_wr_pack_stats *pack_stats;
+	struct mmc_pack_limit_stats *ls;
 	int i;
 	int max_num_of_packed_reqs = 0;
 	char *temp_buf;
@@ -959,6 +1141,19 @@ static ssize_t mmc_wr_pack_stats_read(struct file *filp, char __user *ubuf,
 		strlcat(ubuf, temp_buf, cnt);
 	}
 
+	for (i = 1; pack_stats->limit_stats &&
+		    i <= max_num_of_packed_reqs; ++i) {
+		ls = &pack_stats->limit_stats[i];
+		if (!ls->groups)
+			continue;
+		snprintf(temp_buf, TEMP_BUF_SIZE,
+			 "%s: limit %d: %u packed cmds, %u reqs, %llu KB, %llu KB/s\n",
+			 mmc_hostname(card->host), i, ls->groups, ls->reqs,
+			 ls->sectors >> 1, ls->busy_ns ?
+			 div64_u64(ls->sectors * 500000000ULL, ls->busy_ns) : 0);
+		strlcat(ubuf, temp_buf, cnt);
+	}
+
 	spin_unlock(&pack_stats->lock);
 
 	kfree(temp_buf);
@@ -1182,10 +1377,10 @@ struct mmc_wearout_test_case
 };
 
 
-static int mmc_wearout_busy(struct mmc_command *cmd)
+static int mmc_wearout_busy(u32 status)
 {
-	return !(cmd->resp[0] & R1_READY_FOR_DATA) ||
-		(R1_CURRENT_STATE(cmd->resp[0]) == R1_STATE_PRG);
+	return !(status & R1_READY_FOR_DATA) ||
+		(R1_CURRENT_STATE(status) == R1_STATE_PRG);
 }
 
 
@@ -1194,31 +1389,17 @@ static int mmc_wearout_busy(struct mmc_command *cmd)
  */
 static int mmc_wearout_wait_busy(struct mmc_test_card *test)
 {
-	int ret, busy;
-	struct mmc_command cmd = {0};
+	struct mmc_card *card = test->card;
+	u32 status;
+	int ret;
 
-	busy = 0;
-	do 
-	{
-		memset(&cmd, 0, sizeof(struct mmc_command));
+	ret = mmc_wait_busy(card, MMC_WEAROUT_BUSY_TIMEOUT_MS, true, &status);
+	if (ret || !mmc_wearout_busy(status))
+		return ret;
 
-		cmd.opcode = MMC_SEND_STATUS;
-		cmd.arg = test->card->rca << 16;
-		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	pr_info("%s: Warning: Host did not " "wait for busy state to end.\n",mmc_hostname(card->host));
 
-		ret = mmc_wait_for_cmd(test->card->host, &cmd, 0);
-		if (ret)
-			break;
-
-		if (!busy && mmc_wearout_busy(&cmd)) 
-		{
-			busy = 1;
-			if (test->card->host->caps & MMC_CAP_WAIT_WHILE_BUSY)
-				pr_info("%s: Warning: Host did not " "wait for busy state to end.\n",mmc_hostname(test->card->host));
-		}
-	} while (mmc_wearout_busy(&cmd));
-
-	return ret;
+	return mmc_wait_busy(card, MMC_WEAROUT_BUSY_TIMEOUT_MS, false, NULL);
 }
 
 
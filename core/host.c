@@ -35,6 +35,7 @@ static void mmc_host_classdev_release(struct device *dev)
 {
 	struct mmc_host *host = cls_dev_to_mmc_host(dev);
 	kfree(host->wlock_name);
+	kfree(host->cmd_buf);
 	kfree(host);
 }
 
@@ -439,6 +440,11 @@ struct mmc_host *mmc_alloc_host(int extra, struct device *dev)
 	host->max_blk_size = 512;
 	host->max_blk_count = PAGE_CACHE_SIZE / 512;
 
+	host->poll.max_ns = MMC_POLL_MAX_NS;
+
+	/* not fatal, mmc_get_cmd_buf() falls back to kmalloc() */
+	host->cmd_buf = kmalloc(MMC_CMD_BUFS * MMC_CMD_BUF_SIZE, GFP_KERNEL);
+
 	return host;
 
 free:
@@ -642,9 +648,11 @@ set_perf(struct device *dev, struct device_attribute *attr,
 {
 	struct mmc_host *host = cls_dev_to_mmc_host(dev);
 	int64_t value;
+	bool was_enabled;
 
 	sscanf(buf, "%lld", &value);
 	spin_lock(&host->lock);
+	was_enabled = host->perf_enable;
 	if (!value) {
 		memset(&host->perf, 0, sizeof(host->perf));
 		host->perf_enable = false;
@@ -653,6 +661,12 @@ set_perf(struct device *dev, struct device_attribute *attr,
 	}
 	spin_unlock(&host->lock);
 
+	/* the completion path only accounts while someone is looking */
+	if (!was_enabled && value)
+		mmc_done_trace_get();
+	else if (was_enabled && !value)
+		mmc_done_trace_put();
+
 	return count;
 }
 
@@ -769,6 +783,10 @@ void mmc_free_host(struct mmc_host *host)
 	idr_remove(&mmc_host_idr, host->index);
 	spin_unlock(&mmc_host_lock);
 	wake_lock_destroy(&host->detect_wake_lock);
+#ifdef CONFIG_MMC_PERF_PROFILING
+	if (host->perf_enable)
+		mmc_done_trace_put();
+#endif
 
 	put_device(&host->class_dev);
 }
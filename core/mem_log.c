@@ -14,10 +14,68 @@
 #include <linux/mmc/mem_log.h>
 #include <linux/delay.h>
 #include <linux/export.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "core.h"
 
 
 mem_log_t tmemLog;
 
+/* eMMC (mmc0) only by default, as before */
+unsigned long memlog_host_mask = 1UL;
+
+/*
+ * The completion path only calls into the tracer while some host is
+ * traced, see mmc_done_trace_get().  The reference is taken once the
+ * log is set up, a mask given at load time is just stored until then.
+ */
+static DEFINE_MUTEX(memlog_hosts_lock);
+static bool memlog_inited;
+static bool memlog_key_held;
+
+static void memlog_set_hosts(unsigned long hosts)
+{
+	bool want;
+
+	mutex_lock(&memlog_hosts_lock);
+	ACCESS_ONCE(memlog_host_mask) = hosts;
+	want = memlog_inited && hosts;
+	if (want && !memlog_key_held)
+		mmc_done_trace_get();
+	else if (!want && memlog_key_held)
+		mmc_done_trace_put();
+	memlog_key_held = want;
+	mutex_unlock(&memlog_hosts_lock);
+}
+
+static int memlog_hosts_param_set(const char *val,
+				  const struct kernel_param *kp)
+{
+	unsigned long hosts;
+	int ret;
+
+	ret = kstrtoul(val, 0, &hosts);
+	if (ret)
+		return ret;
+	memlog_set_hosts(hosts);
+	return 0;
+}
+
+static struct kernel_param_ops memlog_hosts_param_ops = {
+	.set = memlog_hosts_param_set,
+	.get = param_get_ulong,
+};
+
+module_param_cb(memlog_hosts, &memlog_hosts_param_ops, &memlog_host_mask,
+		0644);
+MODULE_PARM_DESC(memlog_hosts, "Bitmap of mmc host indexes to trace");
+
 #define MEMLOG_COPY_TO_USER 1
 #include <linux/miscdevice.h>
 
@@ -53,6 +111,96 @@ mem_log_t tmemLog;
 #define IOCTL_STOP_MEMLOG	_IO('u', 0x0)
 #define IOCTL_MEMLOG_BUFFER_RELEASE	_IO('u', 0x2)
 #define IOCTL_MEMLOG_CURRENT_INDEX_COUNT	_IOR('u', 0x3, unsigned long)
+#define IOCTL_MEMLOG_SET_MODE	_IOW('u', 0x4, int)
+#define IOCTL_MEMLOG_GENERATION	_IOR('u', 0x5, unsigned long)
+#define IOCTL_MEMLOG_SET_FREEZE	_IOW('u', 0x6, struct memlog_freeze)
+#define IOCTL_MEMLOG_FROZEN	_IOR('u', 0x7, int)
+#define IOCTL_MEMLOG_SET_HOSTS	_IOW('u', 0x8, unsigned long)
+#define IOCTL_MEMLOG_GET_HOSTS	_IOR('u', 0x9, unsigned long)
+#define IOCTL_MEMLOG_SET_WATERMARK	_IOW('u', 0xa, unsigned int)
+
+#define MEMLOG_DEFAULT_WATERMARK	64
+
+#define MEMLOG_DELTA_MAX	0xffffffffULL
+
+static DEFINE_MUTEX(memlog_read_mutex);
+
+/*
+ * The consumer tail: ours, or the collector's from the mmap consumer
+ * page if it moved forward without passing head.  Anything else it
+ * wrote there is ignored, so it can't make other readers or a stop
+ * mode writer see records twice or garbage.
+ */
+static inline u32 memlog_tail(struct mem_log_cpu *mc)
+{
+	u32 tail = ACCESS_ONCE(mc->tail);
+	u32 req = ACCESS_ONCE(mc->ctl->tail);
+
+	if (req - tail <= ACCESS_ONCE(mc->shared->head) - tail)
+		return req;
+	return tail;
+}
+
+/* reader side, under memlog_read_mutex */
+static inline void memlog_set_tail(struct mem_log_cpu *mc, u32 tail)
+{
+	ACCESS_ONCE(mc->tail) = tail;
+	ACCESS_ONCE(mc->shared->tail) = tail;
+}
+
+static unsigned long memlog_count(void)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	struct mem_log_cpu *mc;
+	u32 unread;
+
+	for_each_possible_cpu(cpu) {
+		mc = per_cpu_ptr(tmemLog.cpu_buf, cpu);
+		unread = ACCESS_ONCE(mc->shared->head) - memlog_tail(mc);
+		count += min_t(unsigned long, unread, tmemLog.max_index);
+	}
+	return count;
+}
+
+/* number of times any ring has wrapped, bumps whenever records are lost */
+static unsigned long memlog_generation(void)
+{
+	unsigned long gen = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		gen += ACCESS_ONCE(per_cpu_ptr(tmemLog.cpu_buf, cpu)->shared->head) /
+			tmemLog.max_index;
+	return gen;
+}
+
+/*
+ * Readers are woken once any ring holds watermark unread records, or
+ * when capture stops so they can drain whatever is left.
+ */
+static int memlog_ready(void)
+{
+	struct mem_log_cpu *mc;
+	unsigned int watermark = ACCESS_ONCE(tmemLog.watermark);
+	int cpu;
+
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
+		return memlog_count() > 0;
+
+	for_each_possible_cpu(cpu) {
+		mc = per_cpu_ptr(tmemLog.cpu_buf, cpu);
+		if (ACCESS_ONCE(mc->shared->head) - memlog_tail(mc) >= watermark)
+			return 1;
+	}
+	return 0;
+}
+
+static void memlog_wakeup(struct irq_work *work)
+{
+	wake_up_interruptible(&tmemLog.wait);
+}
 
 int memlog_open(struct inode *inode, struct file *filp)
 {
@@ -62,28 +210,202 @@ int memlog_open(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/*
+ * Records [tail, reserve) may be touched by the writer, so in wrap mode
+ * anything more than one ring behind reserve is already gone.
+ */
+static inline int memlog_overwritten(struct mem_log_cpu *mc, u32 index)
+{
+	return tmemLog.mode == MEMLOG_MODE_WRAP &&
+		(u32)local_read(&mc->reserve) - index > mc->max_index;
+}
+
+static inline u64 memlog_sync_time(mem_log_rec_t *rec)
+{
+	return ((u64)rec->sector << 32) | rec->ts_delta;
+}
+
+/*
+ * Copy out the oldest unread record across all per-cpu buffers.  Each
+ * buffer is already in time order, so a k-way merge on the completion
+ * time returns one globally ordered stream.  SYNC records are consumed
+ * here and *time is set to the absolute time of the returned record.
+ * Only one consumer may run at a time.  Returns 0 when nothing is left.
+ */
+static int memlog_next_record(mem_log_rec_t *out, u64 *time)
+{
+	struct mem_log_cpu *mc, *oldest;
+	mem_log_rec_t *rec;
+	u64 t, found_time = 0;
+	u32 head, tail, behind;
+	int cpu;
+
+retry:
+	oldest = NULL;
+	for_each_possible_cpu(cpu) {
+		mc = per_cpu_ptr(tmemLog.cpu_buf, cpu);
+		head = ACCESS_ONCE(mc->shared->head);
+		tail = memlog_tail(mc);
+		if (tail != mc->tail)
+			memlog_set_tail(mc, tail);
+		if (head - tail > mc->max_index) {
+			behind = head - tail - mc->max_index;
+			tmemLog.overrun += behind;
+			tail += behind;
+			memlog_set_tail(mc, tail);
+			/* deltas are useless until the next SYNC */
+			mc->read_epoch = 0;
+		}
+		if (tail == head)
+			continue;
+		smp_rmb();
+		rec = &mc->log_buf[tail & (mc->max_index - 1)];
+		if (mem_target_getopt(rec, MEM_LOG_SYNC))
+			t = memlog_sync_time(rec);
+		else
+			t = mc->read_epoch + rec->ts_delta;
+		if (!oldest || t < found_time) {
+			found_time = t;
+			oldest = mc;
+		}
+	}
+
+	if (oldest == NULL)
+		return 0;
+
+	tail = oldest->tail;
+	memcpy(out, &oldest->log_buf[tail & (oldest->max_index - 1)],
+	       sizeof(mem_log_rec_t));
+	smp_rmb();
+	if (memlog_overwritten(oldest, tail)) {
+		/* the writer lapped us during the copy */
+		tmemLog.overrun++;
+		oldest->read_epoch = 0;
+		memlog_set_tail(oldest, tail + 1);
+		goto retry;
+	}
+	/* order the copy before handing the slot back to a stop mode writer */
+	smp_mb();
+	memlog_set_tail(oldest, tail + 1);
+
+	if (mem_target_getopt(out, MEM_LOG_SYNC)) {
+		oldest->read_epoch = memlog_sync_time(out);
+		goto retry;
+	}
+	if (oldest->read_epoch == 0) {
+		/* lost the SYNC this record is relative to */
+		tmemLog.overrun++;
+		goto retry;
+	}
+
+	*time = oldest->read_epoch + out->ts_delta;
+	return 1;
+}
+
+/*
+ * The read() stream is a single timeline: records from all cpus are
+ * re-encoded against the stream epoch, with SYNC records of its own.
+ * Returns the number of records (1 or 2) put in buf.
+ */
+static int memlog_stream_encode(mem_log_rec_t *buf, mem_log_rec_t *rec,
+				u64 time)
+{
+	int n = 0;
+
+	if (tmemLog.stream_epoch == 0 || time < tmemLog.stream_epoch ||
+	    time - tmemLog.stream_epoch > MEMLOG_DELTA_MAX ||
+	    tmemLog.stream_since_sync >= MEMLOG_SYNC_INTERVAL) {
+		memset(&buf[n], 0, sizeof(mem_log_rec_t));
+		mem_target_setopt(&buf[n], MEM_LOG_SYNC);
+		buf[n].ts_delta = (u32)time;
+		buf[n].sector = (u32)(time >> 32);
+		tmemLog.stream_epoch = time;
+		tmemLog.stream_since_sync = 0;
+		n++;
+	}
+
+	memcpy(&buf[n], rec, sizeof(mem_log_rec_t));
+	buf[n].ts_delta = (u32)(time - tmemLog.stream_epoch);
+	tmemLog.stream_since_sync++;
+	return n + 1;
+}
+
+/*
+ * Stream format: struct memlog_stream_hdr at offset 0, then
+ * mem_log_rec_t records.  Every read needs room for a SYNC and a record.
+ */
 ssize_t memlog_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
 {
-	unsigned long buf_len = 0;
-	int result=0;
+	mem_log_rec_t *chunk, rec;
+	size_t chunk_len, want, n;
+	ssize_t copied = 0;
+	u64 time;
 
 	enter();
-	
-	buf_len = __MEM_LOG_BUF_LEN / sizeof(mem_log_parcer_t);		// total size = 16MB, available sampling size = 621378
-	
-	dbg_memlog("total sampling buffer count = %d, read_count = %d, mem_log_parcer_t = %d bytes\n", buf_len, count, sizeof(mem_log_parcer_t));
 
-	result = copy_to_user(buf, (const void *)tmemLog.log_buf, count); 	// (sizeof(mem_log_parcer_t)*buf_len));
+	/* past the stream header, block until there is something to return */
+	if (*f_pos != 0 && memlog_count() == 0 &&
+	    ACCESS_ONCE(tmemLog.enable)) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(tmemLog.wait, memlog_ready() ||
+				ACCESS_ONCE(tmemLog.enable) == 0))
+			return -ERESTARTSYS;
+	}
 
-	if(result<0)
-	{
-		dbg_memlog("error copy_to_user memory..!!\n");
-		return result;
+	if (*f_pos == 0) {
+		if (count < sizeof(struct memlog_stream_hdr) +
+			    2 * sizeof(mem_log_rec_t))
+			return -EINVAL;
+	} else if (count < 2 * sizeof(mem_log_rec_t)) {
+		return -EINVAL;
+	}
+
+	chunk_len = PAGE_SIZE / sizeof(mem_log_rec_t);
+	chunk = kmalloc(chunk_len * sizeof(mem_log_rec_t), GFP_KERNEL);
+	if (chunk == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&memlog_read_mutex);
+	if (*f_pos == 0) {
+		if (copy_to_user(buf, &tmemLog.hdr->stream,
+				 sizeof(struct memlog_stream_hdr))) {
+			copied = -EFAULT;
+			goto out;
+		}
+		copied = sizeof(struct memlog_stream_hdr);
+		tmemLog.stream_epoch = 0;
+	}
+
+	while ((want = (count - copied) / sizeof(mem_log_rec_t)) >= 2) {
+		want = min(want, chunk_len);
+		for (n = 0; n + 2 <= want; ) {
+			if (!memlog_next_record(&rec, &time))
+				break;
+			n += memlog_stream_encode(&chunk[n], &rec, time);
+		}
+		if (n == 0)
+			break;
+
+		if (copy_to_user(buf + copied, chunk,
+				 n * sizeof(mem_log_rec_t))) {
+			dbg_memlog("error copy_to_user memory..!!\n");
+			if (copied == 0)
+				copied = -EFAULT;
+			break;
+		}
+		copied += n * sizeof(mem_log_rec_t);
 	}
-	dbg_memlog("success copy_to_user memory..!! result = %d \n", result);
+out:
+	mutex_unlock(&memlog_read_mutex);
+	kfree(chunk);
+
+	if (copied > 0)
+		*f_pos += copied;
+	dbg_memlog("success copy_to_user memory..!! result = %d \n", copied);
 
 	leave();
-	return count;
+	return copied;
 }
 
 ssize_t memlog_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
@@ -99,6 +421,11 @@ long memlog_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int size;
 	int ctu_result;
+	int mode, frozen;
+	long ret = 0;
+	unsigned long cur_index, gen, hosts;
+	unsigned int watermark;
+	struct memlog_freeze freeze;
 
 	enter();
 
@@ -124,10 +451,75 @@ long memlog_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			break;
 
 		case IOCTL_MEMLOG_CURRENT_INDEX_COUNT:
-			//	unsigned long cur_index = tmemLog.cur_index;
-			//put_user(tmemLog.cur_index,(void *) arg); 
-			dbg_memlog("MEM Log current index count = %d , cmd size = %d \n", tmemLog.cur_index, size);
-			ctu_result = copy_to_user((void *) arg, (const void *) &tmemLog.cur_index, (unsigned long) size);
+			cur_index = memlog_count();
+			dbg_memlog("MEM Log current index count = %lu , cmd size = %d \n", cur_index, size);
+			ctu_result = copy_to_user((void *) arg, (const void *) &cur_index, (unsigned long) size);
+			break;
+
+		case IOCTL_MEMLOG_SET_MODE:
+			if (get_user(mode, (int __user *) arg)) {
+				ret = -EFAULT;
+				break;
+			}
+			if (mode != MEMLOG_MODE_STOP && mode != MEMLOG_MODE_WRAP) {
+				ret = -EINVAL;
+				break;
+			}
+			/* the two modes index the rings differently, start over */
+			memlog_set_enable(0);
+			memlog_release();
+			tmemLog.mode = mode;
+			dbg_memlog("MEM Log mode = %d\n", mode);
+			break;
+
+		case IOCTL_MEMLOG_GENERATION:
+			gen = memlog_generation();
+			if (put_user(gen, (unsigned long __user *) arg))
+				ret = -EFAULT;
+			break;
+
+		case IOCTL_MEMLOG_SET_FREEZE:
+			if (copy_from_user(&freeze, (void __user *) arg,
+					   sizeof(freeze))) {
+				ret = -EFAULT;
+				break;
+			}
+			tmemLog.freeze.latency_ns = freeze.latency_ns;
+			smp_wmb();
+			ACCESS_ONCE(tmemLog.freeze.triggers) = freeze.triggers;
+			dbg_memlog("MEM Log freeze triggers %x latency %llu\n",
+				   freeze.triggers, freeze.latency_ns);
+			break;
+
+		case IOCTL_MEMLOG_SET_HOSTS:
+			if (get_user(hosts, (unsigned long __user *) arg)) {
+				ret = -EFAULT;
+				break;
+			}
+			memlog_set_hosts(hosts);
+			dbg_memlog("MEM Log hosts = %lx\n", hosts);
+			break;
+
+		case IOCTL_MEMLOG_GET_HOSTS:
+			hosts = ACCESS_ONCE(memlog_host_mask);
+			if (put_user(hosts, (unsigned long __user *) arg))
+				ret = -EFAULT;
+			break;
+
+		case IOCTL_MEMLOG_SET_WATERMARK:
+			if (get_user(watermark, (unsigned int __user *) arg)) {
+				ret = -EFAULT;
+				break;
+			}
+			ACCESS_ONCE(tmemLog.watermark) =
+				clamp_t(unsigned int, watermark, 1, tmemLog.max_index);
+			wake_up_interruptible(&tmemLog.wait);
+			break;
+
+		case IOCTL_MEMLOG_FROZEN:
+			frozen = ACCESS_ONCE(tmemLog.frozen);
+			if (put_user(frozen, (int __user *) arg))
+				ret = -EFAULT;
 			break;
 
 		default:
@@ -136,7 +528,42 @@ long memlog_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	mutex_unlock(&memlog_mutex);
 
 	leave();
-	return 0;
+	return ret;
+}
+
+/*
+ * Only the consumer page may be mapped writable, so a collector can hand
+ * its tail back; the header and the rings are read-only.  Map them with
+ * separate calls.
+ */
+static int memlog_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (tmemLog.area == NULL)
+		return -ENODEV;
+	if (off >= tmemLog.area_len || size > tmemLog.area_len - off)
+		return -EINVAL;
+
+	if (off < tmemLog.hdr->ctl_offset ||
+	    off + size > tmemLog.hdr->ctl_offset + tmemLog.ctl_len) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	return remap_vmalloc_range(vma, tmemLog.area, vma->vm_pgoff);
+}
+
+static unsigned int memlog_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(filp, &tmemLog.wait, wait);
+	if (memlog_ready())
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
 }
 
 int memlog_close(struct inode *inode, struct file *filp)
@@ -153,6 +580,8 @@ struct file_operations memlog_fops =
 //	.ioctl = memlog_ioctl,
 	.unlocked_ioctl = memlog_ioctl,
 	.read = memlog_read,
+	.mmap = memlog_mmap,
+	.poll = memlog_poll,
 	.write = memlog_write,
 	.open = memlog_open,
 	.release = memlog_close,
@@ -167,28 +596,91 @@ static struct miscdevice memlog_miscdev = {
 
 //mem_log_t tmemLog;
 
+static void memlog_drain(struct work_struct *work);
+
 int init_memLog(void)
 {		
 	unsigned long buf_len = 0;
+	unsigned long hdr_len, ring_len, offset;
+	struct mem_log_cpu *mc;
+	int cpu;
 	
 	memset(&tmemLog, 0, sizeof(mem_log_t));
 
-	buf_len = __MEM_LOG_BUF_LEN / sizeof(mem_log_parcer_t);
-
-	if (tmemLog.log_buf == NULL)
-		tmemLog.log_buf = (mem_log_parcer_t*)vmalloc(sizeof(mem_log_parcer_t) * buf_len);
-	
-	if (tmemLog.log_buf == NULL) {
+	/*
+	 * split the log budget evenly between the possible cpus, each ring
+	 * a power of two so wrap mode can index it with a mask
+	 */
+	buf_len = __MEM_LOG_BUF_LEN / sizeof(mem_log_rec_t) / num_possible_cpus();
+	if (buf_len == 0) {
+		_err_msg("Log buffer too small!\n");
+		return -1;
+	}
+	buf_len = rounddown_pow_of_two(buf_len);
+
+	/* one area so it can be mmapped: header page(s), then the rings */
+	hdr_len = PAGE_ALIGN(sizeof(struct memlog_mmap_hdr) +
+			     nr_cpu_ids * sizeof(struct memlog_mmap_cpu));
+	tmemLog.ctl_len = PAGE_ALIGN(nr_cpu_ids *
+				     sizeof(struct memlog_mmap_ctl));
+	ring_len = PAGE_ALIGN(sizeof(mem_log_rec_t) * buf_len);
+	tmemLog.area_len = hdr_len + tmemLog.ctl_len +
+		ring_len * num_possible_cpus();
+
+	tmemLog.area = vmalloc_user(tmemLog.area_len);
+	if (tmemLog.area == NULL) {
 		_err_msg("Memory alloc fail!\n");
 		return -1;
 	}
-	
+	tmemLog.hdr = tmemLog.area;
+	tmemLog.hdr->stream.magic = MEMLOG_MAGIC;
+	tmemLog.hdr->stream.version = MEMLOG_VERSION;
+	tmemLog.hdr->stream.hdr_size = sizeof(struct memlog_stream_hdr);
+	tmemLog.hdr->stream.record_size = sizeof(mem_log_rec_t);
+	tmemLog.hdr->stream.clock = MEMLOG_CLOCK_SCHED;
+	tmemLog.hdr->stream.sync_interval = MEMLOG_SYNC_INTERVAL;
+	tmemLog.hdr->hdr_len = hdr_len;
+	tmemLog.hdr->ctl_offset = hdr_len;
+	tmemLog.hdr->nr_cpus = nr_cpu_ids;
+	tmemLog.hdr->ring_records = buf_len;
+	tmemLog.hdr->mode = tmemLog.mode;
+
+	tmemLog.cpu_buf = alloc_percpu(struct mem_log_cpu);
+	if (tmemLog.cpu_buf == NULL) {
+		_err_msg("Memory alloc fail!\n");
+		memlog_destroy();
+		return -1;
+	}
+
+	offset = hdr_len + tmemLog.ctl_len;
+	for_each_possible_cpu(cpu) {
+		mc = per_cpu_ptr(tmemLog.cpu_buf, cpu);
+		mc->log_buf = tmemLog.area + offset;
+		mc->shared = &tmemLog.hdr->cpu[cpu];
+		mc->shared->data_offset = offset;
+		mc->ctl = tmemLog.area + hdr_len +
+			cpu * sizeof(struct memlog_mmap_ctl);
+		mc->max_index = buf_len;
+		local_set(&mc->reserve, 0);
+		local_set(&mc->commit, 0);
+		local_set(&mc->dropped, 0);
+		mc->batch = kzalloc_node(2 * sizeof(struct memlog_batch),
+					 GFP_KERNEL, cpu_to_node(cpu));
+		if (mc->batch == NULL) {
+			_err_msg("Memory alloc fail!\n");
+			memlog_destroy();
+			return -1;
+		}
+		INIT_WORK(&mc->drain, memlog_drain);
+		offset += ring_len;
+	}
 	tmemLog.max_index = buf_len;
-	tmemLog.cur_index = 0;
-	spin_lock_init(&tmemLog.lock);
+	tmemLog.watermark = min_t(unsigned long, MEMLOG_DEFAULT_WATERMARK, buf_len);
+	init_waitqueue_head(&tmemLog.wait);
+	init_irq_work(&tmemLog.wakeup, memlog_wakeup);
 
-	_err_msg("Init Success! // Available Max Line : %lu\n", tmemLog.max_index);
-	_err_msg("Init Success! // mem log buf len : %d // sizeof(mem_log_parcer_t) : %d\n", __MEM_LOG_BUF_LEN, sizeof(mem_log_parcer_t));
+	_err_msg("Init Success! // Available Max Line : %lu x %d cpus\n", tmemLog.max_index, num_possible_cpus());
+	_err_msg("Init Success! // mem log buf len : %d // sizeof(mem_log_rec_t) : %d\n", __MEM_LOG_BUF_LEN, sizeof(mem_log_rec_t));
 
 #if MEMLOG_COPY_TO_USER 
 	{
@@ -209,263 +701,451 @@ int init_memLog(void)
 	memlog_app_add(0, 7);
 #endif	
 
+	memlog_inited = true;
+	memlog_set_hosts(memlog_host_mask);
+
 	return 0;
 }
 
-int memlog_insert(mem_log_parcer_t* log_parcer)
+/*
+ * Publish committed records.  Writers on one cpu can only nest (process
+ * context interrupted by the completion irq), so when commit equals
+ * reserve no write is in flight and head may be moved.  The loop covers
+ * an irq that slipped in between the check and the store: it published
+ * a newer head, which we must not overwrite with an older one.
+ */
+static void memlog_commit(struct mem_log_cpu *mc, int nr)
 {
-	_mdbg_msg("cur : %lu // max : %lu\n", tmemLog.cur_index, tmemLog.max_index);
-	
-	if (tmemLog.cur_index >= tmemLog.max_index) {
-		_err_msg("Max log buff is full!\n");
-		return -1;
-	}
-
-//	memset(&tmemLog.log_buf[*cur_index], 0, sizeof(mem_log_parcer_t));
-	memcpy(&tmemLog.log_buf[tmemLog.cur_index], log_parcer, sizeof(mem_log_parcer_t));
-
-	_mdbg_msg("flag : %d \n", tmemLog.log_buf[tmemLog.cur_index].flag);
+	unsigned long c;
 
-	tmemLog.cur_index++;
-	
-	return 0;
+	local_add(nr, &mc->commit);
+	do {
+		c = local_read(&mc->commit);
+		if (c != local_read(&mc->reserve))
+			return;
+		smp_wmb();
+		ACCESS_ONCE(mc->shared->head) = c;
+	} while (c != local_read(&mc->commit));
 }
 
-int memlog_parcer_print(mem_log_parcer_t* log_parcer)
+/*
+ * Timestamp the record with @now and reserve its slot, plus one for a
+ * SYNC record when the delta would overflow, time went backwards (a
+ * nested writer stamped later but got in first) or the last SYNC is too
+ * far back.  This runs with local irqs off so a nested writer cannot
+ * move the epoch in between; the copy itself runs with irqs on.
+ */
+int memlog_insert(mem_log_rec_t *rec, u64 now)
 {
-	char log_buf[100] = {0,};
-	char cmd[10] = {0,};
-
-	if (log_parcer == NULL)
-		return 0;
-	
-	if (mem_target_getopt(log_parcer, MEM_LOG_APP)) 
-	{
-		if (mem_app_getopt(log_parcer, MEM_LOG_APP_START))  
-		{
-			sprintf(log_buf, "Start logging");			
-		}
-		else {
-			sprintf(log_buf, "End logging");
-		}
+	struct mem_log_cpu *mc;
+	mem_log_rec_t *slot;
+	unsigned long idx, flags;
+	int sync, nr, ret = 0;
+
+	mc = get_cpu_ptr(tmemLog.cpu_buf);
+
+	local_irq_save(flags);
+	sync = mc->epoch == 0 || now < mc->epoch ||
+		now - mc->epoch > MEMLOG_DELTA_MAX ||
+		mc->since_sync >= MEMLOG_SYNC_INTERVAL;
+	nr = sync ? 2 : 1;
+
+	idx = local_read(&mc->reserve);
+	/* in stop mode never pass the consumer */
+	if (tmemLog.mode != MEMLOG_MODE_WRAP &&
+	    (u32)idx + nr - memlog_tail(mc) > mc->max_index) {
+		local_irq_restore(flags);
+		/* no printk here, we may be in the completion irq */
+		local_inc(&mc->dropped);
+		ret = -1;
+		goto out;
 	}
+	local_add(nr, &mc->reserve);
 
-	if (mem_target_getopt(log_parcer, MEM_LOG_MMC)) {
-		if (mem_cmd_getopt(log_parcer, MEM_LOG_READ))
-			sprintf(cmd, "READ");
-		else if (mem_cmd_getopt(log_parcer, MEM_LOG_WRITE))
-			sprintf(cmd, "WRITE");
-		else if (mem_cmd_getopt(log_parcer, MEM_LOG_OPCODE))
-			sprintf(cmd, "COMMAND");
-		else if (mem_cmd_getopt(log_parcer, MEM_LOG_PACKED))
-			sprintf(cmd, "PACKED");
-		
-		if(!strcmp(cmd, "COMMAND"))
-		{
-			sprintf(log_buf, "%15llu elapsed CMD%4u(%s) arg %u ", log_parcer->latency_time, log_parcer->opcode,
-		       			cmd, log_parcer->sector);
-
-		}
-		else if(!strcmp(cmd, "PACKED"))
-		{
-			sprintf(log_buf, "packed arg : %u", log_parcer->packed_cmd_hdr);
-		}
-		else
-		{
-			sprintf(log_buf, "%15llu elapsed CMD%4u(%s) block %u (%u sectors) ", log_parcer->latency_time, log_parcer->opcode,
-		       			cmd, log_parcer->sector, log_parcer->sector_len);
-		}
+	if (sync) {
+		mc->epoch = now;
+		mc->since_sync = 0;
 	}
-	printk(KERN_INFO "%s\n", log_buf);
-	return 0;
+	mc->since_sync++;
+	rec->ts_delta = (u32)(now - mc->epoch);
+	local_irq_restore(flags);
+
+	_mdbg_msg("cur : %lu // max : %lu\n", idx, mc->max_index);
+
+	if (sync) {
+		slot = &mc->log_buf[idx++ & (mc->max_index - 1)];
+		memset(slot, 0, sizeof(mem_log_rec_t));
+		mem_target_setopt(slot, MEM_LOG_SYNC);
+		slot->ts_delta = (u32)now;
+		slot->sector = (u32)(now >> 32);
+	}
+	slot = &mc->log_buf[idx & (mc->max_index - 1)];
+	memcpy(slot, rec, sizeof(mem_log_rec_t));
+	_mdbg_msg("flag : %d \n", slot->flag);
+
+	memlog_commit(mc, nr);
+
+	if (waitqueue_active(&tmemLog.wait) &&
+	    ACCESS_ONCE(mc->shared->head) - memlog_tail(mc) >=
+	    ACCESS_ONCE(tmemLog.watermark))
+		irq_work_queue(&tmemLog.wakeup);
+out:
+	put_cpu_ptr(tmemLog.cpu_buf);
+	
+	return ret;
 }
 
+/*
+ * Called with capture disabled: wait for writers that sampled enable
+ * before it was cleared, then rewind every cpu buffer.
+ */
 int memlog_release(void)
 {
-	memset(tmemLog.log_buf, 0, sizeof(mem_log_parcer_t) * tmemLog.max_index);
-	/*
-	if (tmemLog.log_buf != NULL)
-		vfree(tmemLog.log_buf);
-	*/
+	struct mem_log_cpu *mc;
+	int cpu;
+
+	synchronize_sched();
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu_ptr(tmemLog.cpu_buf, cpu)->drain);
+
+	mutex_lock(&memlog_read_mutex);
+	for_each_possible_cpu(cpu) {
+		mc = per_cpu_ptr(tmemLog.cpu_buf, cpu);
+		memset(mc->log_buf, 0, sizeof(mem_log_rec_t) * mc->max_index);
+		local_set(&mc->reserve, 0);
+		local_set(&mc->commit, 0);
+		local_set(&mc->dropped, 0);
+		mc->epoch = 0;
+		mc->since_sync = 0;
+		mc->read_epoch = 0;
+		mc->shared->head = 0;
+		mc->shared->tail = 0;
+		mc->ctl->tail = 0;
+		mc->tail = 0;
+	}
+	tmemLog.hdr->mode = tmemLog.mode;
+	tmemLog.overrun = 0;
+	tmemLog.frozen = 0;
+	mutex_unlock(&memlog_read_mutex);
 	
-	tmemLog.cur_index = 0;
 	tmemLog.start = MEM_LOG_APP_END;
 	return 0;
 }
 
 int memlog_destroy(void)
 {
-	if (tmemLog.log_buf != NULL)
-		vfree(tmemLog.log_buf);
+	int cpu;
+
+	if (tmemLog.cpu_buf != NULL) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(tmemLog.cpu_buf, cpu)->batch);
+		free_percpu(tmemLog.cpu_buf);
+	}
+	tmemLog.cpu_buf = NULL;
 
+	if (tmemLog.area != NULL)
+		vfree(tmemLog.area);
+	tmemLog.area = NULL;
+	tmemLog.hdr = NULL;
+	tmemLog.area_len = 0;
 	tmemLog.max_index = 0;
-	tmemLog.cur_index = 0;
 	return 0;
 }
 
-void memlog_exit_print_thread(void)
+/*
+ * Flight recorder trigger: stop capture once an armed condition is seen
+ * so the ring keeps the window leading up to the incident.  The packed
+ * header records following this one are dropped, the CMD25 itself is
+ * already in the log.
+ */
+static void memlog_check_freeze(mem_log_rec_t *rec,
+				unsigned long long latency)
 {
-	kthread_stop(tmemLog.kthread);
+	unsigned int triggers = ACCESS_ONCE(tmemLog.freeze.triggers);
+	int fire = 0;
+
+	if (!triggers)
+		return;
+	smp_rmb();
+
+	if ((triggers & MEMLOG_FREEZE_LATENCY) &&
+	    latency >= tmemLog.freeze.latency_ns)
+		fire = 1;
+
+	if ((triggers & MEMLOG_FREEZE_ERROR) && rec->error)
+		fire = 1;
+
+	if (fire) {
+		ACCESS_ONCE(tmemLog.enable) = 0;
+		ACCESS_ONCE(tmemLog.frozen) = 1;
+		/* let a streaming reader drain the frozen window */
+		irq_work_queue(&tmemLog.wakeup);
+	}
 }
 
-static inline void sleep(unsigned sec)
+static inline u8 memlog_req_error(struct mmc_request *mrq)
 {
-	current->state = TASK_INTERRUPTIBLE;
-	schedule_timeout(sec * HZ);
+	u8 error = 0;
+
+	if (mrq->cmd->error)
+		error |= MEMLOG_ERR_CMD;
+	if (mrq->data && mrq->data->error)
+		error |= MEMLOG_ERR_DATA;
+	if (mrq->sbc && mrq->sbc->error)
+		error |= MEMLOG_ERR_SBC;
+	if (mrq->stop && mrq->stop->error)
+		error |= MEMLOG_ERR_STOP;
+	return error;
 }
 
-static int memlog_print_thread(void* arg)
+/* fill latency and queue time from the request's own stamps */
+static u64 memlog_req_times(mem_log_rec_t *rec, u64 done, u64 dispatch,
+			    u64 issue)
 {
-	unsigned long index = 0;
-	unsigned long cur_index = tmemLog.cur_index;
-	mem_log_parcer_t* buf = tmemLog.log_buf;
-	
-	if (cur_index < 1)
-		return 0;
-	
-	do {
-		set_current_state(TASK_INTERRUPTIBLE);
+	u64 latency = 0;
 
-		if (kthread_should_stop()) {
-			break;
-		}		
-		memlog_parcer_print(&buf[index]);
-
-		index++;
-		schedule_timeout(0);
-		//ndelay(1);
-		
-	} while (index < cur_index);
-	set_current_state(TASK_RUNNING);	
-	//memlog_parcer_print(&buf[cur_index - 1]);
+	if (dispatch && done > dispatch)
+		latency = done - dispatch;
+	rec->latency = min_t(u64, latency, MEMLOG_DELTA_MAX);
 
-	memlog_release();
-	return 0;
+	if (issue && dispatch > issue)
+		rec->queue = min_t(u64, dispatch - issue, MEMLOG_DELTA_MAX);
+	return latency;
 }
 
-int memlog_print(void)
+/* snapshot what the record needs, the request is reused once done */
+static void memlog_pending_fill(struct memlog_pending *p,
+				struct mmc_request *mrq)
 {
-	int err = 0;
-	tmemLog.kthread = kthread_run(memlog_print_thread, NULL, "memlog_thread");
-	if (IS_ERR(tmemLog.kthread)) {
-		err = PTR_ERR(tmemLog.kthread);
-		_err_msg("Fail memlog_thread Start! err = %d\n", err);
-		return -1;
-	}
-	return 0;
+	p->done = mrq->done_time ? mrq->done_time : sched_clock();
+	p->dispatch = mrq->dispatch_time;
+	p->issue = mrq->issue_time;
+	p->arg = mrq->cmd->arg;
+	p->opcode = (u8)mrq->cmd->opcode;
+	p->host = mrq->host ? mrq->host->index : 0;
+	p->error = memlog_req_error(mrq);
+	p->synthetic = mrq->synthetic;
+	p->blocks = 0;
+	p->nr_words = 0;
+
+	if (mrq->data && mrq->data->flags == MMC_DATA_WRITE)
+		p->cmd = MEM_LOG_WRITE;
+	else if (mrq->data && mrq->data->flags == MMC_DATA_READ)
+		p->cmd = MEM_LOG_READ;
+	else
+		p->cmd = mrq->data ? 0 : MEM_LOG_OPCODE;
+	if (mrq->data)
+		p->blocks = min_t(unsigned int, mrq->data->blocks, 0xffff);
 }
 
-int memlog_emmc_add(struct mmc_request *mrq, unsigned long long curTime, unsigned long long latency)
+static void memlog_packed_insert(int host, u32 packed_cmd_hdr, u8 hdr,
+				 u64 now)
 {
-	mem_log_parcer_t log_parcer;
-	unsigned long flags;
+	mem_log_rec_t log_parcer;
 
-	spin_lock_irqsave(&tmemLog.lock, flags);
-	
-	if (tmemLog.enable == 0) {
-		spin_unlock_irqrestore(&tmemLog.lock, flags);
-		return 0;
-	}
-	memset(&log_parcer, 0, sizeof(mem_log_parcer_t));
+	memset(&log_parcer, 0, sizeof(mem_log_rec_t));
 	
 	mem_target_setopt(&log_parcer, MEM_LOG_MMC);
+	mem_cmd_setopt(&log_parcer, MEM_LOG_PACKED);
+	
+	log_parcer.sector = packed_cmd_hdr;
+	log_parcer.opcode = hdr;
+	log_parcer.host = host;
+	memlog_insert(&log_parcer, now);
+}
 
-	if(mrq->data)
-	{
-		if (mrq->data->flags == MMC_DATA_WRITE)
-			mem_cmd_setopt(&log_parcer, MEM_LOG_WRITE);
-		else if (mrq->data->flags == MMC_DATA_READ)
-			mem_cmd_setopt(&log_parcer, MEM_LOG_READ);
-		log_parcer.sector = (unsigned int)mrq->cmd->arg;
-		log_parcer.sector_len = mrq->data->blocks;
-	}
-	else
-	{
-		mem_cmd_setopt(&log_parcer, MEM_LOG_OPCODE);
-		log_parcer.sector = (unsigned int)mrq->cmd->arg;
-		log_parcer.sector_len = 0;
+/*
+ * The request record, then its packed header: word 0 is the header,
+ * (CMD23 arg, CMD18/25 arg) pairs start at word 2.  The header records
+ * carry the completion time so they stay next to their request.
+ */
+static void memlog_pending_insert(struct memlog_pending *p,
+				  const u32 *words)
+{
+	mem_log_rec_t log_parcer;
+	u64 latency;
+	int i;
+
+	memset(&log_parcer, 0, sizeof(mem_log_rec_t));
+	
+	mem_target_setopt(&log_parcer, MEM_LOG_MMC);
+	mem_cmd_setopt(&log_parcer, p->cmd);
+	log_parcer.sector = p->arg;
+	log_parcer.blocks = p->blocks;
+
+	latency = memlog_req_times(&log_parcer, p->done, p->dispatch,
+				   p->issue);
+	log_parcer.opcode = p->opcode;
+	log_parcer.host = p->host;
+	log_parcer.error = p->error;
+
+	memlog_insert(&log_parcer, p->done);
+	memlog_check_freeze(&log_parcer, latency);
+
+	/* a freeze on this record drops its packed header, see above */
+	if (!p->nr_words || ACCESS_ONCE(tmemLog.frozen))
+		return;
+	memlog_packed_insert(p->host, words[0], 0, p->done);
+	for (i = 2; i + 1 < p->nr_words; i += 2) {
+		memlog_packed_insert(p->host, words[i], 1, p->done);
+		memlog_packed_insert(p->host, words[i + 1], 2, p->done);
 	}
+}
 
-	log_parcer.cur_time = curTime;
-	log_parcer.latency_time = latency;
-	log_parcer.opcode = (unsigned int)mrq->cmd->opcode;
+int memlog_emmc_add(struct mmc_request *mrq)
+{
+	struct memlog_pending p;
 
-	memlog_insert(&log_parcer);
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
+		return 0;
+
+	memlog_pending_fill(&p, mrq);
+	memlog_pending_insert(&p, NULL);
 
-	spin_unlock_irqrestore(&tmemLog.lock, flags);
-	
 	return 0;
 }
 
-int memlog_packed_add(u32 packed_cmd_hdr, u8 hdr)
+/*
+ * Completion path version of memlog_emmc_add(): only copies the
+ * request's stamps into this cpu's batch, the records are built and
+ * inserted by memlog_drain().  A full batch drops the completion and
+ * counts it in dropped, like a full ring; a packed header that no
+ * longer fits the batch's words counts its records there too.
+ */
+int memlog_emmc_defer(struct mmc_request *mrq, const u32 *packed_hdr,
+		      int nr_words)
 {
-	mem_log_parcer_t log_parcer;
+	struct mem_log_cpu *mc;
+	struct memlog_batch *b;
+	struct memlog_pending *p;
 	unsigned long flags;
 
-	spin_lock_irqsave(&tmemLog.lock, flags);
-
-	if(tmemLog.enable == 0){
-		spin_unlock_irqrestore(&tmemLog.lock, flags);
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
 		return 0;
+
+	local_irq_save(flags);
+	mc = this_cpu_ptr(tmemLog.cpu_buf);
+	b = &mc->batch[mc->fill];
+	if (b->nr == MEMLOG_BATCH) {
+		local_inc(&mc->dropped);
+		goto out;
 	}
-	memset(&log_parcer, 0, sizeof(mem_log_parcer_t));
-	
-	mem_target_setopt(&log_parcer, MEM_LOG_MMC);
-	mem_cmd_setopt(&log_parcer, MEM_LOG_PACKED);
-	
-	log_parcer.packed_cmd_hdr = packed_cmd_hdr;
-	log_parcer.hdr = hdr;
-	memlog_insert(&log_parcer);
 
-	spin_unlock_irqrestore(&tmemLog.lock, flags);
+	p = &b->req[b->nr];
+	memlog_pending_fill(p, mrq);
+	if (nr_words && b->nr_words + nr_words <= MEMLOG_BATCH_WORDS) {
+		memcpy(&b->words[b->nr_words], packed_hdr,
+		       nr_words * sizeof(u32));
+		p->nr_words = nr_words;
+		b->nr_words += nr_words;
+	} else if (nr_words) {
+		/* the header record and two per (CMD23, CMD18/25) pair */
+		local_add(1 + max(nr_words - 2, 0) / 2 * 2, &mc->dropped);
+	}
+
+	if (b->nr++ == 0)
+		queue_work_on(smp_processor_id(), system_wq, &mc->drain);
+out:
+	local_irq_restore(flags);
+	return 0;
+}
+
+/*
+ * Swap batches with irqs off, then build the records from the one
+ * just filled.  The work is bound to the cpu that owns the batch and
+ * never runs concurrently with itself there, so the other batch is
+ * free until the next swap.
+ */
+static void memlog_drain(struct work_struct *work)
+{
+	struct mem_log_cpu *mc = container_of(work, struct mem_log_cpu, drain);
+	struct memlog_batch *b;
+	unsigned int i, words = 0;
+
+	local_irq_disable();
+	b = &mc->batch[mc->fill];
+	mc->fill ^= 1;
+	local_irq_enable();
+
+	/* nothing staged after a freeze trigger fired goes in */
+	for (i = 0; i < b->nr && !ACCESS_ONCE(tmemLog.frozen); i++) {
+		if (!b->req[i].synthetic)
+			memlog_pending_insert(&b->req[i], &b->words[words]);
+		words += b->req[i].nr_words;
+	}
+	b->nr = 0;
+	b->nr_words = 0;
+}
+
+int memlog_packed_add(int host, u32 packed_cmd_hdr, u8 hdr)
+{
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
+		return 0;
+
+	memlog_packed_insert(host, packed_cmd_hdr, hdr, sched_clock());
 
 	return 0;
 }
 
 
-int memlog_opcode_add(struct mmc_request *mrq, unsigned long long curTime, unsigned long long latency)
+int memlog_opcode_add(struct mmc_request *mrq)
 {
-	mem_log_parcer_t log_parcer;
-	unsigned long flags;
+	mem_log_rec_t log_parcer;
 
-	spin_lock_irqsave(&tmemLog.lock, flags);
-	
-	if (tmemLog.enable == 0) {
-		spin_unlock_irqrestore(&tmemLog.lock, flags);
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
 		return 0;
-	}
-	memset(&log_parcer, 0, sizeof(mem_log_parcer_t));
+
+	memset(&log_parcer, 0, sizeof(mem_log_rec_t));
 	
 	mem_target_setopt(&log_parcer, MEM_LOG_MMC);
 
 	mem_cmd_setopt(&log_parcer, MEM_LOG_OPCODE);
 
-	log_parcer.sector = (unsigned int)mrq->cmd->arg;
-	log_parcer.sector_len = 0;
-	log_parcer.cur_time = curTime;
-	log_parcer.latency_time = latency;
-	log_parcer.opcode = (unsigned int)mrq->cmd->opcode;
+	log_parcer.sector = (u32)mrq->cmd->arg;
+	memlog_req_times(&log_parcer,
+			 mrq->done_time ? mrq->done_time : sched_clock(),
+			 mrq->dispatch_time, mrq->issue_time);
+	log_parcer.opcode = (u8)mrq->cmd->opcode;
+	log_parcer.host = mrq->host ? mrq->host->index : 0;
+	log_parcer.error = memlog_req_error(mrq);
 
-	memlog_insert(&log_parcer);
+	memlog_insert(&log_parcer, mrq->done_time ? mrq->done_time : sched_clock());
+
+	return 0;
+}
+
+/* queue thread, packing, urgent and bkops/clock events, see MEMLOG_BLK_* */
+int memlog_block_add(int host, u8 event, u32 sector, u32 blocks,
+		     u8 app_num, u8 arg)
+{
+	mem_log_rec_t log_parcer;
+
+	if (ACCESS_ONCE(tmemLog.enable) == 0 || !memlog_host_traced(host))
+		return 0;
+
+	memset(&log_parcer, 0, sizeof(mem_log_rec_t));
+	mem_target_setopt(&log_parcer, MEM_LOG_BLOCK);
+
+	log_parcer.opcode = event;
+	log_parcer.sector = sector;
+	log_parcer.blocks = min_t(u32, blocks, 0xffff);
+	log_parcer.host = host;
+	log_parcer.app_num = app_num;
+	log_parcer.arg = arg;
+	memlog_insert(&log_parcer, sched_clock());
 
-	spin_unlock_irqrestore(&tmemLog.lock, flags);
-	
 	return 0;
 }
 
 int memlog_app_add(int start, int name)
 {
-	mem_log_parcer_t log_parcer;
-	unsigned long flags;
+	mem_log_rec_t log_parcer;
 
-	spin_lock_irqsave(&tmemLog.lock, flags);
-	
-	if (tmemLog.enable == 0) {
-		spin_unlock_irqrestore(&tmemLog.lock, flags);
+	if (ACCESS_ONCE(tmemLog.enable) == 0)
 		return 0;
-	}
 
-	memset(&log_parcer, 0, sizeof(mem_log_parcer_t));
+
+	memset(&log_parcer, 0, sizeof(mem_log_rec_t));
 	mem_target_setopt(&log_parcer, MEM_LOG_APP);
 
 	if (name == MEM_APP_MANUAL) {
@@ -486,31 +1166,30 @@ int memlog_app_add(int start, int name)
 		}
 	}
 	
-	log_parcer.cur_time = sched_clock();
 	log_parcer.app_num = name;
-	memlog_insert(&log_parcer);
+	memlog_insert(&log_parcer, sched_clock());
 
 	tmemLog.start = MEM_LOG_APP_START;
 	if (start == MEM_LOG_APP_START)
-		_err_msg("flag :%d // start :%d // name : %d // time: %llu\n", log_parcer.flag, start, name, log_parcer.cur_time);
+		_err_msg("flag :%d // start :%d // name : %d // time: %llu\n", log_parcer.flag, start, name, sched_clock());
 
-	spin_unlock_irqrestore(&tmemLog.lock, flags);
-	
 	return 0;
 }
 
 int memlog_set_enable(int enable)
 {
-	unsigned long flags;
-	
-	spin_lock_irqsave(&tmemLog.lock, flags);
-	tmemLog.enable = enable;
-	spin_unlock_irqrestore(&tmemLog.lock, flags);
+	if (enable)
+		ACCESS_ONCE(tmemLog.frozen) = 0;
+	ACCESS_ONCE(tmemLog.enable) = enable;
 
 	if (enable == 1)
-		_err_msg("Enable Memory Log! // Available Line : %lu\n", tmemLog.max_index - tmemLog.cur_index);
+		_err_msg("Enable Memory Log! // Available Line : %lu\n",
+			 tmemLog.max_index * num_possible_cpus() - memlog_count());
 	else
 		_err_msg("Disable Memory Log!\n");
+
+	/* a blocked reader drains the rest and sees end of data */
+	wake_up_interruptible(&tmemLog.wait);
 	
 	return 0;
 }
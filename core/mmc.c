@@ -216,8 +216,8 @@ static int mmc_get_ext_csd(struct mmc_card *card, u8 **new_ext_csd)
 		return 0;
 
 	/*
-	 * As the ext_csd is so large and mostly unused, we don't store the
-	 * raw block in mmc_card.
+	 * Callers keep a copy in card->cached_ext_csd, see
+	 * mmc_ext_csd_update().
 	 */
 	ext_csd = kmalloc(512, GFP_KERNEL);
 	if (!ext_csd) {
@@ -323,7 +323,7 @@ static int mmc_read_ext_csd(struct mmc_card *card, u8 *ext_csd)
 	}
 
 	card->ext_csd.rev = ext_csd[EXT_CSD_REV];
-	if (card->ext_csd.rev > 7) {
+	if (card->ext_csd.rev > 8) {
 		pr_err("%s: unrecognised EXT_CSD revision %d\n",
 			mmc_hostname(card->host), card->ext_csd.rev);
 		err = -EINVAL;
@@ -594,6 +594,15 @@ static int mmc_read_ext_csd(struct mmc_card *card, u8 *ext_csd)
 			ext_csd[EXT_CSD_MAX_PACKED_READS];
 	}
 
+	/* eMMC v5.1 or later */
+	if (card->ext_csd.rev >= 8) {
+		if (ext_csd[EXT_CSD_CMDQ_SUPPORT] & 0x1)
+			card->ext_csd.cmdq_depth =
+				(ext_csd[EXT_CSD_CMDQ_DEPTH] & 0x1f) + 1;
+		else
+			card->ext_csd.cmdq_depth = 0;
+	}
+
 out:
 	return err;
 }
@@ -678,6 +687,10 @@ static int mmc_compare_ext_csds(struct mmc_card *card, unsigned bus_width)
 		err = -EINVAL;
 	#endif
 
+	/* the read verified the bus, it is also the newest EXT_CSD we have */
+	if (!err)
+		mmc_ext_csd_update(card, bw_ext_csd);
+
 out:
 	mmc_free_ext_csd(bw_ext_csd);
 	return err;
@@ -1230,9 +1243,9 @@ int mmc_set_clock_bus_speed(struct mmc_card *card, unsigned long freq)
 		mmc_set_timing(card->host, MMC_TIMING_LEGACY);
 		mmc_set_clock(card->host, MMC_HIGH_26_MAX_DTR);
 
-		err = mmc_select_hs(card, &card->cached_ext_csd);
+		err = mmc_select_hs(card, card->cached_ext_csd);
 	} else {
-		err = mmc_select_hs400(card, &card->cached_ext_csd);
+		err = mmc_select_hs400(card, card->cached_ext_csd);
 	}
 
 	return err;
@@ -1486,7 +1499,8 @@ static int mmc_init_card(struct mmc_host *host, u32 ocr,
 		err = mmc_get_ext_csd(card, &ext_csd);
 		if (err)
 			goto free_card;
-		memcpy(&card->cached_ext_csd, &ext_csd, sizeof(ext_csd));
+		if (ext_csd)
+			mmc_ext_csd_update(card, ext_csd);
 		err = mmc_read_ext_csd(card, ext_csd);
 		if (err)
 			goto free_card;
@@ -1499,6 +1513,8 @@ static int mmc_init_card(struct mmc_host *host, u32 ocr,
 		if (err)
 			goto free_card;
 #endif
+		/* generic table, e.g. packed command limits per part */
+		mmc_fixup_device(card, NULL);
 
 		/* If doing byte addressing, check if required to do sector
 		 * addressing.  Handle the case of <2GB cards needing sector
@@ -1655,6 +1671,20 @@ static int mmc_init_card(struct mmc_host *host, u32 ocr,
 
 	}
 
+	/*
+	 * Command queuing is selected here but CMDQ_MODE_EN stays off: the
+	 * legacy read/write commands the rest of the stack uses are illegal
+	 * while it is set, so the block driver switches it on only around
+	 * its queued bursts.  A re-init always leaves the card with it off.
+	 */
+	card->ext_csd.cmdq_en = false;
+	card->ext_csd.cmdq_tasks = 0;
+	if (!(host->caps2 & MMC_CAP2_CMD_QUEUE) || mmc_host_is_spi(host))
+		card->ext_csd.cmdq_depth = 0;
+	if (!oldcard && card->ext_csd.cmdq_depth)
+		pr_info("%s: command queue depth %d\n", mmc_hostname(host),
+			card->ext_csd.cmdq_depth);
+
 	if (!oldcard) {
 		if ((host->caps2 & MMC_CAP2_PACKED_CMD) &&
 		    (card->ext_csd.max_packed_writes > 0)) {
@@ -1669,6 +1699,12 @@ static int mmc_init_card(struct mmc_host *host, u32 ocr,
 				GFP_KERNEL);
 			if (!card->wr_pack_stats.packing_events)
 				goto free_card;
+			card->wr_pack_stats.limit_stats = kzalloc(
+				(card->ext_csd.max_packed_writes + 1) *
+				sizeof(*card->wr_pack_stats.limit_stats),
+				GFP_KERNEL);
+			if (!card->wr_pack_stats.limit_stats)
+				goto free_card;
 		}
 
 		if (card->ext_csd.bkops_en) {
@@ -10,7 +10,9 @@
  */
 
 #include <linux/slab.h>
+#include <linux/err.h>
 #include <linux/export.h>
+#include <linux/jiffies.h>
 #include <linux/types.h>
 #include <linux/scatterlist.h>
 
@@ -23,6 +25,16 @@
 
 #define MMC_OPS_TIMEOUT_MS	(10 * 60 * 1000) /* 10 minute timeout */
 
+/*
+ * How long the volatile EXT_CSD fields may be served from the cache,
+ * unless the card signalled an event, see mmc_get_ext_csd_cached().
+ */
+#define MMC_EXT_CSD_VOLATILE_MS	1000
+
+/* back-off between CMD13 polls while the card is busy */
+#define MMC_BUSY_POLL_MIN_US	32
+#define MMC_BUSY_POLL_MAX_US	1024
+
 static int _mmc_select_card(struct mmc_host *host, struct mmc_card *card)
 {
 	int err;
@@ -268,8 +280,12 @@ mmc_send_cxd_data(struct mmc_card *card, struct mmc_host *host,
 
 	/* dma onto stack is unsafe/nonportable, but callers to this
 	 * routine normally provide temporary on-stack buffers ...
+	 * unless they got one of the host's own
 	 */
-	data_buf = kmalloc(len, GFP_KERNEL);
+	if (mmc_is_cmd_buf(host, buf))
+		data_buf = buf;
+	else
+		data_buf = mmc_get_cmd_buf(host, len);
 	if (data_buf == NULL)
 		return -ENOMEM;
 
@@ -306,8 +322,10 @@ mmc_send_cxd_data(struct mmc_card *card, struct mmc_host *host,
 
 	mmc_wait_for_req(host, &mrq);
 
-	memcpy(buf, data_buf, len);
-	kfree(data_buf);
+	if (data_buf != buf) {
+		memcpy(buf, data_buf, len);
+		mmc_put_cmd_buf(host, data_buf);
+	}
 
 	if (cmd.error)
 		return cmd.error;
@@ -356,6 +374,97 @@ int mmc_send_cid(struct mmc_host *host, u32 *cid)
 	return 0;
 }
 
+/* EXT_CSD bytes the card changes on its own */
+static const struct {
+	u16	start;
+	u16	len;
+} mmc_ext_csd_volatile[] = {
+	{ EXT_CSD_PACKED_FAILURE_INDEX, 2 },	/* and PACKED_CMD_STATUS */
+	{ EXT_CSD_EXP_EVENTS_STATUS, 2 },
+	{ EXT_CSD_CORRECTLY_PRG_SECTORS_NUM, 4 },
+	{ EXT_CSD_BKOPS_STATUS, 1 },
+	{ EXT_CSD_PRE_EOL_INFO, 3 },		/* and both life time estimates */
+};
+
+/* write-only fields that trigger an action, they read back as 0 */
+static bool mmc_ext_csd_is_trigger(unsigned int index)
+{
+	return index == EXT_CSD_FLUSH_CACHE || index == EXT_CSD_BKOPS_START ||
+		index == EXT_CSD_SANITIZE_START;
+}
+
+static bool mmc_ext_csd_is_volatile(unsigned int index, unsigned int len)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mmc_ext_csd_volatile); i++)
+		if (index < mmc_ext_csd_volatile[i].start +
+			    mmc_ext_csd_volatile[i].len &&
+		    index + len > mmc_ext_csd_volatile[i].start)
+			return true;
+	return false;
+}
+
+/**
+ *	mmc_ext_csd_update - take a freshly read EXT_CSD into the cache
+ *	@card: MMC card, host claimed by the caller
+ *	@ext_csd: the 512 bytes just read with CMD8
+ */
+void mmc_ext_csd_update(struct mmc_card *card, const u8 *ext_csd)
+{
+	if (!card->cached_ext_csd)
+		card->cached_ext_csd = kmalloc(512, GFP_KERNEL);
+	if (!card->cached_ext_csd)
+		return;
+
+	memcpy(card->cached_ext_csd, ext_csd, 512);
+	card->ext_csd_time = jiffies;
+	card->ext_csd_stale = false;
+}
+EXPORT_SYMBOL_GPL(mmc_ext_csd_update);
+
+/**
+ *	mmc_get_ext_csd_cached - the EXT_CSD, without a CMD8 when possible
+ *	@card: MMC card, host claimed by the caller
+ *	@index: first byte the caller is going to look at
+ *	@len: number of bytes from @index
+ *
+ *	The cache is filled at init and follows our own CMD6 writes.  It
+ *	is only refreshed with CMD8 when [@index, @index + @len) covers a
+ *	field the card changes on its own, and that was read more than
+ *	MMC_EXT_CSD_VOLATILE_MS ago or after mmc_ext_csd_invalidate().
+ *	The returned buffer belongs to the card and stays valid until the
+ *	host is released.  Returns an ERR_PTR() if the read fails.
+ */
+const u8 *mmc_get_ext_csd_cached(struct mmc_card *card, unsigned int index,
+				 unsigned int len)
+{
+	u8 *ext_csd;
+	int err;
+
+	if (card->cached_ext_csd && (!mmc_ext_csd_is_volatile(index, len) ||
+	    (!card->ext_csd_stale &&
+	     time_before(jiffies, card->ext_csd_time +
+			 msecs_to_jiffies(MMC_EXT_CSD_VOLATILE_MS)))))
+		return card->cached_ext_csd;
+
+	ext_csd = mmc_get_cmd_buf(card->host, 512);
+	if (!ext_csd)
+		return ERR_PTR(-ENOMEM);
+
+	err = mmc_send_ext_csd(card, ext_csd);
+	if (!err)
+		mmc_ext_csd_update(card, ext_csd);
+	mmc_put_cmd_buf(card->host, ext_csd);
+
+	if (err)
+		return ERR_PTR(err);
+	if (!card->cached_ext_csd)
+		return ERR_PTR(-ENOMEM);
+	return card->cached_ext_csd;
+}
+EXPORT_SYMBOL_GPL(mmc_get_ext_csd_cached);
+
 int mmc_send_ext_csd(struct mmc_card *card, u8 *ext_csd)
 {
 	return mmc_send_cxd_data(card, card->host, MMC_SEND_EXT_CSD,
@@ -412,7 +521,6 @@ int __mmc_switch(struct mmc_card *card, u8 set, u8 index, u8 value,
 {
 	int err;
 	struct mmc_command cmd = {0};
-	unsigned long timeout;
 	u32 status;
 
 	BUG_ON(!card);
@@ -437,28 +545,28 @@ int __mmc_switch(struct mmc_card *card, u8 set, u8 index, u8 value,
 	if (err)
 		return err;
 
-	/* No need to check card status in case of unblocking command */
-	if (!use_busy_signal)
-		return 0;
+	/* flush, BKOPS and sanitize all move the card's status fields */
+	if (mmc_ext_csd_is_trigger(index))
+		mmc_ext_csd_invalidate(card);
 
-	/* Must check status to be sure of no errors */
-	timeout = jiffies + msecs_to_jiffies(MMC_OPS_TIMEOUT_MS);
-	do {
-		err = mmc_send_status(card, &status);
-		if (err)
-			return err;
-		if (card->host->caps & MMC_CAP_WAIT_WHILE_BUSY)
-			break;
-		if (mmc_host_is_spi(card->host))
-			break;
+	/*
+	 * No need to check card status in case of unblocking command.
+	 * Whether the byte took is unknown then, so drop the cached copy
+	 * rather than leave the old value in it.
+	 */
+	if (!use_busy_signal) {
+		mmc_ext_csd_invalidate(card);
+		return 0;
+	}
 
-		/* Timeout if the device never leaves the program state. */
-		if (time_after(jiffies, timeout)) {
-			pr_err("%s: Card stuck in programming state! %s\n",
-				mmc_hostname(card->host), __func__);
-			return -ETIMEDOUT;
-		}
-	} while (R1_CURRENT_STATE(status) == R1_STATE_PRG);
+	/*
+	 * Must check status to be sure of no errors.  Only the end of PRG
+	 * is waited for and CMD13 is retried, as before the common helper.
+	 */
+	err = __mmc_wait_busy(card, MMC_OPS_TIMEOUT_MS, true, false,
+			      MMC_CMD_RETRIES, &status);
+	if (err)
+		return err;
 
 	if (mmc_host_is_spi(card->host)) {
 		if (status & R1_SPI_ILLEGAL_COMMAND)
@@ -471,6 +579,10 @@ int __mmc_switch(struct mmc_card *card, u8 set, u8 index, u8 value,
 			return -EBADMSG;
 	}
 
+	/* the byte was written, keep the cached EXT_CSD in line */
+	if (card->cached_ext_csd && !mmc_ext_csd_is_trigger(index))
+		card->cached_ext_csd[index] = value;
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(__mmc_switch);
@@ -515,6 +627,83 @@ int mmc_send_status(struct mmc_card *card, u32 *status)
 	return 0;
 }
 
+/**
+ *	__mmc_wait_busy - wait for the card to finish programming
+ *	@card: card to wait for
+ *	@timeout_ms: how long the card may stay busy
+ *	@hw_busy: the last command was R1b or a write, so a host that
+ *		waits while busy has already seen DAT0 released
+ *	@need_ready: also wait for READY_FOR_DATA, not only the end of PRG
+ *	@retries: retries of each CMD13
+ *	@status: if not NULL, the last card status with the error bits of
+ *		all polls ORed in
+ *
+ *	A host with MMC_CAP_WAIT_WHILE_BUSY signals the end of busy with
+ *	its completion, then a single CMD13 only collects the status.
+ *	Otherwise CMD13 is polled until the card is out of the programming
+ *	state (and ready for data with @need_ready), backing off between
+ *	polls so that a long erase or flush doesn't keep the bus busy with
+ *	status commands.  SPI status has no state, it is only read once.
+ */
+int __mmc_wait_busy(struct mmc_card *card, unsigned int timeout_ms,
+		    bool hw_busy, bool need_ready, int retries, u32 *status)
+{
+	struct mmc_host *host = card->host;
+	struct mmc_command cmd = {0};
+	unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned int delay_us = MMC_BUSY_POLL_MIN_US;
+	u32 errors = 0;
+	int err;
+
+	hw_busy = hw_busy && (host->caps & MMC_CAP_WAIT_WHILE_BUSY);
+
+	for (;;) {
+		memset(&cmd, 0, sizeof(struct mmc_command));
+		cmd.opcode = MMC_SEND_STATUS;
+		if (!mmc_host_is_spi(host))
+			cmd.arg = card->rca << 16;
+		cmd.flags = MMC_RSP_SPI_R2 | MMC_RSP_R1 | MMC_CMD_AC;
+		err = mmc_wait_for_cmd(host, &cmd, retries);
+		if (err)
+			return err;
+
+		if (hw_busy || mmc_host_is_spi(host))
+			break;
+		errors |= R1_STATUS(cmd.resp[0]);
+		if ((!need_ready || (cmd.resp[0] & R1_READY_FOR_DATA)) &&
+		    R1_CURRENT_STATE(cmd.resp[0]) != R1_STATE_PRG)
+			break;
+
+		/* Timeout if the device never leaves the program state. */
+		if (time_after(jiffies, timeout)) {
+			pr_err("%s: Card stuck in programming state! %s\n",
+				mmc_hostname(host), __func__);
+			err = -ETIMEDOUT;
+			break;
+		}
+
+		usleep_range(delay_us, delay_us * 2);
+		delay_us = min(delay_us * 2, MMC_BUSY_POLL_MAX_US);
+	}
+
+	if (status)
+		*status = cmd.resp[0] | errors;
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(__mmc_wait_busy);
+
+/*
+ * The usual wait: until the card is ready for data again, CMD13 not
+ * retried else we can't see errors.
+ */
+int mmc_wait_busy(struct mmc_card *card, unsigned int timeout_ms,
+		  bool hw_busy, u32 *status)
+{
+	return __mmc_wait_busy(card, timeout_ms, hw_busy, true, 0, status);
+}
+EXPORT_SYMBOL_GPL(mmc_wait_busy);
+
 static int
 mmc_send_bus_test(struct mmc_card *card, struct mmc_host *host, u8 opcode,
 		  u8 len)
@@ -532,7 +721,7 @@ mmc_send_bus_test(struct mmc_card *card, struct mmc_host *host, u8 opcode,
 	/* dma onto stack is unsafe/nonportable, but callers to this
 	 * routine normally provide temporary on-stack buffers ...
 	 */
-	data_buf = kmalloc(len, GFP_KERNEL);
+	data_buf = mmc_get_cmd_buf(host, len);
 	if (!data_buf)
 		return -ENOMEM;
 
@@ -543,7 +732,7 @@ mmc_send_bus_test(struct mmc_card *card, struct mmc_host *host, u8 opcode,
 	else {
 		pr_err("%s: Invalid bus_width %d\n",
 		       mmc_hostname(host), len);
-		kfree(data_buf);
+		mmc_put_cmd_buf(host, data_buf);
 		return -EINVAL;
 	}
 
@@ -584,7 +773,7 @@ mmc_send_bus_test(struct mmc_card *card, struct mmc_host *host, u8 opcode,
 				break;
 			}
 	}
-	kfree(data_buf);
+	mmc_put_cmd_buf(host, data_buf);
 
 	if (cmd.error)
 		return cmd.error;
@@ -649,3 +838,105 @@ int mmc_send_hpi_cmd(struct mmc_card *card, u32 *status)
 
 	return 0;
 }
+
+/**
+ *	mmc_cmdq_enable - switch eMMC command queuing on or off
+ *	@card: the MMC card
+ *	@enable: new CMDQ_MODE_EN value
+ *
+ *	The queue must be empty when turning it off.
+ */
+int mmc_cmdq_enable(struct mmc_card *card, bool enable)
+{
+	int err;
+
+	if (!card->ext_csd.cmdq_depth)
+		return -EOPNOTSUPP;
+	if (card->ext_csd.cmdq_en == enable)
+		return 0;
+
+	err = mmc_switch(card, EXT_CSD_CMD_SET_NORMAL, EXT_CSD_CMDQ_MODE_EN,
+			 enable ? 1 : 0, card->ext_csd.generic_cmd6_time);
+	if (!err)
+		card->ext_csd.cmdq_en = enable;
+
+	return err;
+}
+EXPORT_SYMBOL(mmc_cmdq_enable);
+
+/**
+ *	mmc_cmdq_queue_task - queue a task with CMD44 and CMD45
+ *	@card: the MMC card
+ *	@params: CMD44 argument, see MMC_QUE_TASK_PARAMS
+ *	@addr: start address of the task, CMD45 argument
+ *
+ *	The data moves later with MMC_EXECUTE_READ_TASK or
+ *	MMC_EXECUTE_WRITE_TASK once the queue status register reports the
+ *	task ready.
+ */
+int mmc_cmdq_queue_task(struct mmc_card *card, u32 params, u32 addr)
+{
+	struct mmc_command cmd = {0};
+	int err;
+
+	cmd.opcode = MMC_QUE_TASK_PARAMS;
+	cmd.arg = params;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	err = mmc_wait_for_cmd(card->host, &cmd, 0);
+	if (!err && (cmd.resp[0] & R1_CMDQ_ERRORS))
+		err = -EIO;
+	if (err)
+		return err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = MMC_QUE_TASK_ADDR;
+	cmd.arg = addr;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	err = mmc_wait_for_cmd(card->host, &cmd, 0);
+	if (!err && (cmd.resp[0] & R1_CMDQ_ERRORS))
+		err = -EIO;
+
+	return err;
+}
+EXPORT_SYMBOL(mmc_cmdq_queue_task);
+
+/**
+ *	mmc_cmdq_get_qsr - read the queue status register
+ *	@card: the MMC card
+ *	@qsr: bit N set when task N is ready for execution
+ */
+int mmc_cmdq_get_qsr(struct mmc_card *card, u32 *qsr)
+{
+	struct mmc_command cmd = {0};
+	int err;
+
+	cmd.opcode = MMC_SEND_STATUS;
+	cmd.arg = card->rca << 16 | MMC_SEND_STATUS_SQS;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	err = mmc_wait_for_cmd(card->host, &cmd, MMC_CMD_RETRIES);
+	if (err)
+		return err;
+
+	*qsr = cmd.resp[0];
+	return 0;
+}
+EXPORT_SYMBOL(mmc_cmdq_get_qsr);
+
+/**
+ *	mmc_cmdq_discard - drop queued tasks with CMD48
+ *	@card: the MMC card
+ *	@op: MMC_CMDQ_DISCARD_QUEUE or MMC_CMDQ_DISCARD_TASK
+ *	@task: task id for MMC_CMDQ_DISCARD_TASK
+ */
+int mmc_cmdq_discard(struct mmc_card *card, u8 op, u8 task)
+{
+	struct mmc_command cmd = {0};
+
+	cmd.opcode = MMC_CMDQ_TASK_MGMT;
+	cmd.arg = MMC_CMDQ_TASK_ID(task) | op;
+	cmd.flags = MMC_RSP_R1B | MMC_CMD_AC;
+
+	return mmc_wait_for_cmd(card->host, &cmd, MMC_CMD_RETRIES);
+}
+EXPORT_SYMBOL(mmc_cmdq_discard);
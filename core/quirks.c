@@ -59,6 +59,16 @@ static void add_quirk_for_sdio_devices(struct mmc_card *card, int data)
 		card->quirks |= data;
 }
 
+/*
+ * Cap the number of requests in one packed command below what the
+ * card advertises, for parts whose vendor recommends doing so
+ */
+static void set_packed_limit(struct mmc_card *card, int data)
+{
+	if (mmc_card_mmc(card))
+		card->packed_limit = data;
+}
+
 static const struct mmc_fixup mmc_fixup_methods[] = {
 	/* by default sdio devices are considered CLK_GATING broken */
 	/* good cards will be whitelisted as they are tested */
@@ -87,6 +97,10 @@ static const struct mmc_fixup mmc_fixup_methods[] = {
 	SDIO_FIXUP(SDIO_VENDOR_ID_STE, SDIO_DEVICE_ID_STE_CW1200,
 		   add_quirk, MMC_QUIRK_BROKEN_BYTE_MODE_512),
 
+	/* Toshiba recommends packing no more than 8 requests */
+	MMC_FIXUP(CID_NAME_ANY, CID_MANFID_TOSHIBA, CID_OEMID_ANY,
+		  set_packed_limit, 8),
+
 	END_FIXUP
 };
 
@@ -238,7 +238,7 @@ static int mmc_read_ssr(struct mmc_card *card)
 		return 0;
 	}
 
-	ssr = kmalloc(64, GFP_KERNEL);
+	ssr = mmc_get_cmd_buf(card->host, 64);
 	if (!ssr)
 		return -ENOMEM;
 
@@ -272,7 +272,7 @@ static int mmc_read_ssr(struct mmc_card *card)
 			"size.\n", mmc_hostname(card->host));
 	}
 out:
-	kfree(ssr);
+	mmc_put_cmd_buf(card->host, ssr);
 	return err;
 }
 
@@ -296,7 +296,7 @@ static int mmc_read_switch(struct mmc_card *card)
 
 	err = -EIO;
 
-	status = kmalloc(64, GFP_KERNEL);
+	status = mmc_get_cmd_buf(card->host, 64);
 	if (!status) {
 		pr_err("%s: could not allocate a buffer for "
 			"switch capabilities.\n",
@@ -369,7 +369,7 @@ static int mmc_read_switch(struct mmc_card *card)
 	}
 
 out:
-	kfree(status);
+	mmc_put_cmd_buf(card->host, status);
 
 	return err;
 }
@@ -396,7 +396,7 @@ int mmc_sd_switch_hs(struct mmc_card *card)
 
 	err = -EIO;
 
-	status = kmalloc(64, GFP_KERNEL);
+	status = mmc_get_cmd_buf(card->host, 64);
 	if (!status) {
 		pr_err("%s: could not allocate a buffer for "
 			"switch capabilities.\n", mmc_hostname(card->host));
@@ -417,7 +417,7 @@ int mmc_sd_switch_hs(struct mmc_card *card)
 	}
 
 out:
-	kfree(status);
+	mmc_put_cmd_buf(card->host, status);
 
 	return err;
 }
@@ -723,7 +723,7 @@ static int mmc_sd_init_uhs_card(struct mmc_card *card)
 	if (!(card->csd.cmdclass & CCC_SWITCH))
 		return 0;
 
-	status = kmalloc(64, GFP_KERNEL);
+	status = mmc_get_cmd_buf(card->host, 64);
 	if (!status) {
 		pr_err("%s: could not allocate a buffer for "
 			"switch capabilities.\n", mmc_hostname(card->host));
@@ -770,7 +770,7 @@ static int mmc_sd_init_uhs_card(struct mmc_card *card)
 	}
 
 out:
-	kfree(status);
+	mmc_put_cmd_buf(card->host, status);
 
 	return err;
 }
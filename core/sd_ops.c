@@ -264,7 +264,7 @@ int mmc_app_send_scr(struct mmc_card *card, u32 *scr)
 	/* dma onto stack is unsafe/nonportable, but callers to this
 	 * routine normally provide temporary on-stack buffers ...
 	 */
-	data_buf = kmalloc(sizeof(card->raw_scr), GFP_KERNEL);
+	data_buf = mmc_get_cmd_buf(card->host, sizeof(card->raw_scr));
 	if (data_buf == NULL)
 		return -ENOMEM;
 
@@ -288,7 +288,7 @@ int mmc_app_send_scr(struct mmc_card *card, u32 *scr)
 	mmc_wait_for_req(card->host, &mrq);
 
 	memcpy(scr, data_buf, sizeof(card->raw_scr));
-	kfree(data_buf);
+	mmc_put_cmd_buf(card->host, data_buf);
 
 	if (cmd.error)
 		return cmd.error;
@@ -1248,6 +1248,7 @@ msmsdcc_start_command_deferred(struct msmsdcc_host *host,
 			(!host->curr.mrq->sbc &&
 			(cmd->opcode == MMC_READ_SINGLE_BLOCK ||
 			cmd->opcode == MMC_READ_MULTIPLE_BLOCK ||
+			cmd->opcode == MMC_EXECUTE_READ_TASK ||
 			cmd->opcode == SD_IO_RW_EXTENDED))) {
 			msmsdcc_enable_cdr_cm_sdc4_dll(host);
 			if (host->en_auto_cmd19 &&
@@ -2317,6 +2318,7 @@ msmsdcc_request(struct mmc_host *mmc, struct mmc_request *mrq)
 
 		if ((mrq->cmd->opcode == MMC_WRITE_BLOCK) ||
 		    (mrq->cmd->opcode == MMC_WRITE_MULTIPLE_BLOCK) ||
+		    (mrq->cmd->opcode == MMC_EXECUTE_WRITE_TASK) ||
 		    ((mrq->cmd->opcode == SD_IO_RW_EXTENDED) &&
 		     is_data_pend_for_cmd53(host)))
 			host->curr.use_wr_data_pend = true;
@@ -4418,6 +4420,38 @@ out:
 	return err;
 }
 
+/*
+ * msmsdcc_poll_request() - run the irq handler if status is pending
+ * @mmc: host being polled by the core
+ * @mrq: request the core is spinning on
+ *
+ * The handler takes the host lock, so racing with the real interrupt
+ * only means one of them finds the status already cleared.  ADM and BAM
+ * transfers finish from their own callbacks, which MMCISTATUS knows
+ * nothing about, so those are refused.
+ */
+static int msmsdcc_poll_request(struct mmc_host *mmc,
+				struct mmc_request *mrq)
+{
+	struct msmsdcc_host *host = mmc_priv(mmc);
+	unsigned long flags;
+
+	if (mrq->data && msmsdcc_is_dma_possible(host, mrq->data))
+		return -EOPNOTSUPP;
+
+	if (!atomic_read(&host->clks_on) || host->sdcc_irq_disabled)
+		return 0;
+
+	if (!(readl_relaxed(host->base + MMCISTATUS) &
+	      readl_relaxed(host->base + MMCIMASK0) & ~MCI_IRQ_PIO))
+		return 0;
+
+	local_irq_save(flags);
+	msmsdcc_irq(host->core_irqres->start, host);
+	local_irq_restore(flags);
+	return 0;
+}
+
 static const struct mmc_host_ops msmsdcc_ops = {
 	.enable		= msmsdcc_enable,
 	.disable	= msmsdcc_disable,
@@ -4432,6 +4466,7 @@ static const struct mmc_host_ops msmsdcc_ops = {
 	.stop_request = msmsdcc_stop_request,
 	.get_xfer_remain = msmsdcc_get_xfer_remain,
 	.notify_load = msmsdcc_notify_load,
+	.poll_request = msmsdcc_poll_request,
 };
 
 static void msmsdcc_enable_status_gpio(struct msmsdcc_host *host)
@@ -6159,12 +6194,15 @@ msmsdcc_probe(struct platform_device *pdev)
 				MMC_CAP_SET_XPC_180);
 
 	mmc->caps2 |= MMC_CAP2_PACKED_WR;
+	mmc->caps2 |= MMC_CAP2_PACKED_RD;
 	mmc->caps2 |= MMC_CAP2_PACKED_WR_CONTROL;
 	mmc->caps2 |= (MMC_CAP2_BOOTPART_NOACC | MMC_CAP2_DETECT_ON_ERR);
 	mmc->caps2 |= MMC_CAP2_SANITIZE;
 	mmc->caps2 |= MMC_CAP2_CACHE_CTRL;
 	mmc->caps2 |= MMC_CAP2_POWEROFF_NOTIFY;
 	mmc->caps2 |= MMC_CAP2_STOP_REQUEST;
+	mmc->caps2 |= MMC_CAP2_MULTI_PRE_REQ;
+	mmc->caps2 |= MMC_CAP2_CMD_QUEUE;
 	mmc->caps2 |= MMC_CAP2_ASYNC_SDIO_IRQ_4BIT_MODE;
 
 	if (plat->nonremovable)
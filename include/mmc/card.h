@@ -57,6 +57,9 @@ struct mmc_ext_csd {
 	u8			max_packed_writes;
 	u8			max_packed_reads;
 	u8			packed_event_en;
+	u8			cmdq_depth;		/* 0: no command queue */
+	bool			cmdq_en;		/* CMDQ_MODE_EN is set */
+	u8			cmdq_tasks;		/* queued, no CMD6/tuning */
 	unsigned int		part_time;		/* Units: ms */
 	unsigned int		sa_timeout;		/* Units: 100ns */
 	unsigned int		generic_cmd6_time;	/* Units: 10ms */
@@ -222,8 +225,17 @@ enum mmc_blk_status {
 	MMC_BLK_NO_REQ_TO_STOP,
 };
 
+/* packed write results for one packed limit value */
+struct mmc_pack_limit_stats {
+	u32 groups;
+	u32 reqs;
+	u64 sectors;
+	u64 busy_ns;		/* dispatch to done of the packed commands */
+};
+
 struct mmc_wr_pack_stats {
 	u32 *packing_events;
+	struct mmc_pack_limit_stats *limit_stats;	/* indexed by limit */
 	u32 pack_stop_reason[MAX_REASONS];
 	spinlock_t lock;
 	bool enabled;
@@ -388,6 +400,7 @@ struct mmc_card {
 	unsigned int	part_curr;
 
 	struct mmc_wr_pack_stats wr_pack_stats; /* packed commands stats*/
+	u8			packed_limit;	/* vendor cap on packed reqs, 0 if none */
 
 	struct mmc_bkops_info	bkops_info;
 
@@ -395,7 +408,10 @@ struct mmc_card {
 	unsigned int		idle_timeout;
 	struct notifier_block        reboot_notify;
 	bool issue_long_pon;
+	/* see mmc_get_ext_csd_cached(), only used with the host claimed */
 	u8 *cached_ext_csd;
+	unsigned long ext_csd_time;	/* jiffies of the last CMD8 */
+	bool ext_csd_stale;		/* volatile fields need a CMD8 */
 };
 
 /*
@@ -418,6 +434,15 @@ static inline bool mmc_large_sec(struct mmc_card *card)
 	return card->ext_csd.data_sector_size == 4096;
 }
 
+/*
+ * The card reported an event, the volatile EXT_CSD fields (status,
+ * exception events, life time) can't be taken from the cache.
+ */
+static inline void mmc_ext_csd_invalidate(struct mmc_card *card)
+{
+	card->ext_csd_stale = true;
+}
+
 /*
  *  The world is not perfect and supplies us with broken mmc/sdio devices.
  *  For at least some of these bugs we need a work-around.
@@ -135,10 +135,18 @@ struct mmc_request {
 	struct mmc_command	*cmd;
 	struct mmc_data		*data;
 	struct mmc_command	*stop;
+	struct mmc_request	*pre_mrq;	/* sent and waited for first */
 
 	struct completion	completion;
 	void			(*done)(struct mmc_request *);/* completion function */
 	struct mmc_host		*host;
+
+	/* sched_clock() stamps, zero until set */
+	u64			issue_time;	/* handed to the core */
+	u64			dispatch_time;	/* handed to host->ops->request */
+	u64			done_time;	/* mmc_request_done() */
+
+	bool			synthetic;	/* mmc_done_bench(), no side effects */
 };
 
 struct mmc_card;
@@ -149,9 +157,18 @@ extern int mmc_read_bkops_status(struct mmc_card *);
 extern bool mmc_card_is_prog_state(struct mmc_card *);
 extern struct mmc_async_req *mmc_start_req(struct mmc_host *,
 					   struct mmc_async_req *, int *);
+extern void mmc_prep_async_req(struct mmc_host *, struct mmc_async_req *);
+extern void mmc_unprep_async_req(struct mmc_host *, struct mmc_async_req *);
+extern int mmc_cmdq_enable(struct mmc_card *, bool);
+extern int mmc_cmdq_queue_task(struct mmc_card *, u32, u32);
+extern int mmc_cmdq_get_qsr(struct mmc_card *, u32 *);
+extern int mmc_cmdq_discard(struct mmc_card *, u8, u8);
 extern int mmc_interrupt_hpi(struct mmc_card *);
 extern void mmc_wait_for_req(struct mmc_host *, struct mmc_request *);
 extern int mmc_wait_for_cmd(struct mmc_host *, struct mmc_command *, int);
+extern void *mmc_get_cmd_buf(struct mmc_host *, unsigned int);
+extern void mmc_put_cmd_buf(struct mmc_host *, void *);
+extern bool mmc_is_cmd_buf(struct mmc_host *, const void *);
 extern int mmc_app_cmd(struct mmc_host *, struct mmc_card *);
 extern int mmc_wait_for_app_cmd(struct mmc_host *, struct mmc_card *,
 	struct mmc_command *, int);
@@ -165,6 +182,12 @@ extern int mmc_switch(struct mmc_card *, u8, u8, u8, unsigned int);
 extern int mmc_switch_ignore_timeout(struct mmc_card *, u8, u8, u8,
 				     unsigned int);
 extern int mmc_send_ext_csd(struct mmc_card *card, u8 *ext_csd);
+extern const u8 *mmc_get_ext_csd_cached(struct mmc_card *, unsigned int,
+					unsigned int);
+extern void mmc_ext_csd_update(struct mmc_card *, const u8 *);
+extern int __mmc_wait_busy(struct mmc_card *, unsigned int, bool, bool, int,
+			   u32 *);
+extern int mmc_wait_busy(struct mmc_card *, unsigned int, bool, u32 *);
 
 #define MMC_ERASE_ARG		0x00000000
 #define MMC_SECURE_ERASE_ARG	0x80000000
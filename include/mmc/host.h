@@ -150,6 +150,14 @@ struct mmc_host_ops {
 	int	(*notify_load)(struct mmc_host *, enum mmc_load);
 	int	(*stop_request)(struct mmc_host *host);
 	unsigned int	(*get_xfer_remain)(struct mmc_host *host);
+	/*
+	 * Optional, called with the host claimed while the core spins on a
+	 * short synchronous request: handle a pending completion as the irq
+	 * handler would.  Must be safe against the real irq firing.  Returns
+	 * a negative errno if polling can never complete @mrq, the core then
+	 * stops spinning on its opcode.
+	 */
+	int	(*poll_request)(struct mmc_host *host, struct mmc_request *mrq);
 };
 
 struct mmc_card;
@@ -167,6 +175,8 @@ struct mmc_async_req {
 	int (*err_check) (struct mmc_card *, struct mmc_async_req *);
 	/* Reinserts request back to the block layer */
 	void (*reinsert_req) (struct mmc_async_req *);
+	/* pre_req already done by mmc_prep_async_req() */
+	bool prepared;
 	/* update what part of request is not done (packed_fail_idx) */
 	int (*update_interrupted_req) (struct mmc_card *,
 			struct mmc_async_req *);
@@ -188,6 +198,7 @@ struct mmc_context_info {
 	bool			is_new_req;
 	bool			is_waiting_last_req;
 	bool			is_urgent;
+	int			stop_remain;	/* bytes left when stopped */
 	wait_queue_head_t	wait;
 	spinlock_t		lock;
 };
@@ -197,6 +208,45 @@ struct mmc_hotplug {
 	void *handler_priv;
 };
 
+/*
+ * Completed data request latency (dispatch to done), log2 buckets of
+ * 1024ns: bucket 0 is < 1.024us, bucket n is [2^(n-1), 2^n) * 1024ns.
+ * Sizes are log2 buckets too: <= 4K, <= 8K, ... <= 128K, > 128K.
+ */
+#define MMC_LAT_HIST_DIRS	2	/* 0 read, 1 write */
+#define MMC_LAT_HIST_SIZES	7
+#define MMC_LAT_HIST_BUCKETS	26
+
+struct mmc_lat_hist {
+	u64	buckets[MMC_LAT_HIST_DIRS][MMC_LAT_HIST_SIZES]
+		       [MMC_LAT_HIST_BUCKETS];
+};
+
+/*
+ * Hybrid polling of short synchronous requests, see mmc_poll_for_req().
+ * lat_ns is an average of dispatch to completion per opcode; the core
+ * spins up to twice that, capped at max_ns (0 turns polling off),
+ * before it sleeps on the completion.  An opcode without an average
+ * gets the whole max_ns once (tried); one the host refused to poll is
+ * not spun on again (nopoll).  Setting max_ns clears both.
+ */
+#define MMC_POLL_OPCODES	64
+#define MMC_POLL_MAX_NS		50000
+
+struct mmc_poll {
+	unsigned int	max_ns;
+	u32		lat_ns[MMC_POLL_OPCODES];
+	unsigned long	hits[MMC_POLL_OPCODES];		/* done while spinning */
+	unsigned long	misses[MMC_POLL_OPCODES];	/* spun, then slept */
+	unsigned long	skips[MMC_POLL_OPCODES];	/* too slow to spin */
+	DECLARE_BITMAP(tried, MMC_POLL_OPCODES);
+	DECLARE_BITMAP(nopoll, MMC_POLL_OPCODES);
+};
+
+/* DMA-safe buffers for the data of internal commands, per host */
+#define MMC_CMD_BUFS		2
+#define MMC_CMD_BUF_SIZE	512
+
 struct mmc_host {
 	struct device		*parent;
 	struct device		class_dev;
@@ -301,6 +351,9 @@ struct mmc_host {
 #define MMC_CAP2_HS400_1_8V	(1 << 21)        /* can support */
 #define MMC_CAP2_HS400_1_2V	(1 << 22)        /* can support */
 #define MMC_CAP2_CORE_PM	(1 << 23)       /* use PM framework */
+/* pre_req state is kept per request, several may be outstanding */
+#define MMC_CAP2_MULTI_PRE_REQ	(1 << 24)
+#define MMC_CAP2_CMD_QUEUE	(1 << 25)	/* Allow eMMC command queuing */
 #define MMC_CAP2_HS400		(MMC_CAP2_HS400_1_8V | \
 				 MMC_CAP2_HS400_1_2V)
 	mmc_pm_flag_t		pm_caps;	/* supported pm features */
@@ -402,10 +455,14 @@ struct mmc_host {
 		unsigned long wbytes_drv;  /* Wr bytes MMC Host  */
 		ktime_t rtime_drv;	   /* Rd time  MMC Host  */
 		ktime_t wtime_drv;	   /* Wr time  MMC Host  */
-		ktime_t start;
 	} perf;
 	bool perf_enable;
 #endif
+	struct mmc_lat_hist	lat_hist;	/* see mmc_lat_hist_update() */
+	struct mmc_poll		poll;
+	/* see mmc_get_cmd_buf() */
+	u8			*cmd_buf;	/* MMC_CMD_BUFS * MMC_CMD_BUF_SIZE */
+	unsigned long		cmd_buf_used;
 	struct mmc_ios saved_ios;
 	struct {
 		unsigned long	busy_time_us;
@@ -414,7 +471,7 @@ struct mmc_host {
 		unsigned long	polling_delay_ms;
 		unsigned int	up_threshold;
 		unsigned int	down_threshold;
-		ktime_t		start_busy;
+		u64		start_busy;	/* sched_clock() */
 		bool		enable;
 		bool		initialized;
 		bool		in_progress;
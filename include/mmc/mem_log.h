@@ -22,7 +22,11 @@
 #include <linux/mmc/core.h>
 #include <linux/blkdev.h>
 #include <linux/sched.h>
-#include <linux/kthread.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <asm/local.h>
 
 #ifndef CONFIG_FMBT_MEM_LOG_BUF_SHIFT
 #define CONFIG_FMBT_MEM_LOG_BUF_SHIFT	0
@@ -35,6 +39,7 @@
 #define MEM_LOG_SCSI		0x02	/* 010 */
 #define MEM_LOG_BLOCK		0x03	/* 011 */
 #define MEM_LOG_APP			0x04	/* 100 */
+#define MEM_LOG_SYNC		0x05	/* 101 */
 
 #define MEM_LOG_READ		0x01	/* 001 */
 #define MEM_LOG_WRITE		0x02	/* 010 */
@@ -75,32 +80,72 @@ enum MEM_APP_NAME {
 	MEM_APP_MANUAL,
 };
 
-#pragma pack(1)
-/* total 27byte */
-typedef struct _MEM_LOG_PARCER_T{
-	char flag;
-	char app_num;
-	unsigned int sector;			/* if opcode_add then sector is opcode number */
-	unsigned int sector_len;
-	unsigned long long cur_time;
-	unsigned long long latency_time;
-	//unsigned char queue_count;
-	unsigned char opcode;			/* if block_add then opcode is queue_count */
-	unsigned int packed_cmd_hdr;
-	unsigned char hdr;
-}mem_log_parcer_t;
+#define MEMLOG_MAGIC		0x474c4d4d	/* "MMLG" */
+#define MEMLOG_VERSION		3		/* v3: read-only mmap header */
+#define MEMLOG_CLOCK_SCHED	0		/* sched_clock(), ns */
 
-typedef struct _MEM_LOG_T{
-	mem_log_parcer_t* log_buf;
-	unsigned long max_index;
-	unsigned long cur_index;
-	int start;
-	int enable;
-	spinlock_t lock;
-	struct task_struct	*kthread;
-	struct semaphore	thread_sem;
-} mem_log_t;
+/* a SYNC record is emitted at least this often on each ring */
+#define MEMLOG_SYNC_INTERVAL	256
+
+/*
+ * Stream header.  read() returns it at offset 0 and the mmap header
+ * starts with it, so a decoder can check what it is about to parse.
+ */
+struct memlog_stream_hdr {
+	__u32	magic;		/* MEMLOG_MAGIC */
+	__u16	version;	/* MEMLOG_VERSION */
+	__u16	hdr_size;	/* sizeof(struct memlog_stream_hdr) */
+	__u16	record_size;	/* sizeof(mem_log_rec_t) */
+	__u8	clock;		/* MEMLOG_CLOCK_* */
+	__u8	reserved;
+	__u32	sync_interval;	/* MEMLOG_SYNC_INTERVAL */
+};
+
+/*
+ * Trace record, 24 bytes, naturally aligned.  Timestamps are deltas
+ * from the epoch set by the last MEM_LOG_SYNC record of the same
+ * stream (a per-cpu ring, or the merged read() stream); a SYNC record
+ * carries the new epoch as (sector << 32 | ts_delta).
+ *   MEM_LOG_MMC/MEM_LOG_PACKED: sector is the packed header word and
+ *                               opcode its index (0 header, 1 arg, 2 len)
+ *   MEM_LOG_APP:                app_num is the MEM_APP_NAME
+ *   MEM_LOG_BLOCK:              opcode is the MEMLOG_BLK_* event, app_num
+ *                               and arg as documented there
+ */
+typedef struct _MEM_LOG_REC_T {
+	__u32	ts_delta;	/* completion time, ns since the epoch */
+	__u32	latency;	/* dispatch to completion, ns, saturates */
+	__u32	sector;		/* cmd arg */
+	__u16	blocks;
+	__u8	opcode;
+	__u8	flag;		/* mem_target/mem_cmd/mem_app bits */
+	__u8	host;		/* mmc host index */
+	__u8	app_num;
+	__u8	error;		/* MEMLOG_ERR_* */
+	__u8	arg;		/* event specific */
+	__u32	queue;		/* issue to dispatch, ns, saturates (v2) */
+} mem_log_rec_t;
+
+#define MEMLOG_ERR_CMD		(1 << 0)
+#define MEMLOG_ERR_DATA		(1 << 1)
+#define MEMLOG_ERR_SBC		(1 << 2)
+#define MEMLOG_ERR_STOP		(1 << 3)
 
+/* MEM_LOG_BLOCK events */
+enum MEMLOG_BLK_EVENT {
+	MEMLOG_BLK_FETCH	= 1,	/* queue thread fetched a request,
+					 * app_num = data direction */
+	MEMLOG_BLK_PACK,		/* packed list built, app_num = requests,
+					 * arg = mmc_packed_stop_reasons */
+	MEMLOG_BLK_REINSERT,		/* urgent, request handed back to the
+					 * block layer, app_num = packed requests */
+	MEMLOG_BLK_BKOPS_START,		/* app_num = bkops status level */
+	MEMLOG_BLK_BKOPS_STOP,		/* HPI'd, app_num = 1 if it failed */
+	MEMLOG_BLK_CLK_SCALE,		/* sector = new clock in kHz,
+					 * app_num = mmc_load state */
+};
+
+#pragma pack(1)
 typedef struct _PACKED_CMD_T{
 	unsigned int packed_cmd_hdr[128];
 	unsigned char num_packed;
@@ -108,17 +153,160 @@ typedef struct _PACKED_CMD_T{
 } packed_cmd_t;
 #pragma pack()
 
+/*
+ * /dev/memlog mmap layout.  Offset 0 is the header, hdr_len bytes long,
+ * written by the kernel only and mapped read-only.  The consumer page at
+ * ctl_offset is the only part that may be mapped read-write: a collector
+ * stores the tail it wants in ctl[n].tail, and the kernel takes it as
+ * long as it lies between cpu[n].tail and cpu[n].head.  The per-cpu
+ * rings follow at cpu[n].data_offset, read-only.  Indices are free
+ * running, record i of a ring lives in slot (i & (ring_records - 1));
+ * records [tail, head) are unread.
+ */
+struct memlog_mmap_cpu {
+	__u32	head;		/* producer: records published */
+	__u32	tail;		/* consumer: records consumed, as accepted */
+	__u32	data_offset;	/* byte offset of the ring in the mapping */
+	__u32	reserved;
+};
+
+struct memlog_mmap_ctl {
+	__u32	tail;		/* collector: records it has consumed */
+};
+
+struct memlog_mmap_hdr {
+	struct memlog_stream_hdr stream;
+	__u32	hdr_len;
+	__u32	nr_cpus;
+	__u32	ring_records;	/* per cpu, power of two */
+	__u32	mode;		/* MEMLOG_MODE_* */
+	__u32	ctl_offset;	/* struct memlog_mmap_ctl per cpu */
+	struct memlog_mmap_cpu cpu[0];
+};
+
+/*
+ * Completions are only staged in the completion path, the record is
+ * built and inserted by mem_log_cpu.drain, see memlog_emmc_defer().
+ * words is the packed command header of the request, if any.
+ */
+#define MEMLOG_BATCH		32
+#define MEMLOG_BATCH_WORDS	256
+
+struct memlog_pending {
+	u64	done;
+	u64	dispatch;
+	u64	issue;
+	u32	arg;
+	u16	blocks;
+	u16	nr_words;	/* packed header words in the batch */
+	u8	opcode;
+	u8	cmd;		/* MEM_LOG_READ/WRITE/OPCODE */
+	u8	host;
+	u8	error;		/* MEMLOG_ERR_* */
+	u8	synthetic;	/* staged, never inserted */
+};
+
+struct memlog_batch {
+	unsigned int		nr;
+	unsigned int		nr_words;
+	struct memlog_pending	req[MEMLOG_BATCH];
+	u32			words[MEMLOG_BATCH_WORDS];
+};
+
+/*
+ * Per-CPU trace buffer.  Only the owning CPU writes to it, so claiming a
+ * slot needs nothing stronger than a local_t update:
+ *   reserve - slots handed out to writers (may run ahead while nested)
+ *   commit  - slots whose record has been completely written
+ *   head    - number of records visible to readers, published in the
+ *             shared header by the outermost writer once commit has
+ *             caught up with reserve
+ * max_index is a power of two.  In MEMLOG_MODE_STOP a writer never
+ * passes the consumer tail; in MEMLOG_MODE_WRAP it overwrites unread
+ * records and head / max_index is the number of times the ring wrapped.
+ */
+struct mem_log_cpu {
+	mem_log_rec_t		*log_buf;
+	struct memlog_mmap_cpu	*shared;	/* head/tail in the header */
+	struct memlog_mmap_ctl	*ctl;		/* collector's tail, untrusted */
+	u32			tail;		/* consumer tail, authoritative */
+	unsigned long		max_index;
+	local_t			reserve;
+	local_t			commit;
+	local_t			dropped;	/* records lost, buffer full */
+	u64			epoch;		/* writer, last SYNC time */
+	unsigned int		since_sync;	/* writer, records since SYNC */
+	u64			read_epoch;	/* reader, last SYNC seen */
+	struct memlog_batch	*batch;		/* two, filled with irqs off */
+	unsigned int		fill;		/* batch being filled */
+	struct work_struct	drain;		/* bound to this cpu */
+};
+
+/* capture modes, IOCTL_MEMLOG_SET_MODE */
+#define MEMLOG_MODE_STOP	0	/* stop recording when full */
+#define MEMLOG_MODE_WRAP	1	/* flight recorder, overwrite oldest */
+
+/* freeze triggers, IOCTL_MEMLOG_SET_FREEZE */
+#define MEMLOG_FREEZE_LATENCY	(1 << 0)	/* latency >= latency_ns */
+#define MEMLOG_FREEZE_ERROR	(1 << 1)	/* cmd/data/stop error */
+
+struct memlog_freeze {
+	unsigned int		triggers;
+	unsigned long long	latency_ns;
+};
+
+typedef struct _MEM_LOG_T{
+	struct mem_log_cpu __percpu *cpu_buf;
+	void *area;				/* header + rings, vmalloc_user */
+	unsigned long area_len;
+	unsigned long ctl_len;			/* consumer page(s) */
+	struct memlog_mmap_hdr *hdr;
+	unsigned long max_index;		/* records per cpu */
+	int start;
+	int enable;
+	int mode;
+	int frozen;				/* a freeze trigger fired */
+	struct memlog_freeze freeze;
+	unsigned long overrun;			/* overwritten before read */
+	u64 stream_epoch;			/* read() stream, last SYNC */
+	unsigned int stream_since_sync;
+	unsigned int watermark;			/* wake readers, records/cpu */
+	wait_queue_head_t wait;			/* blocking read() and poll() */
+	struct irq_work wakeup;			/* wake from any context */
+} mem_log_t;
+
+
+/* bit n set: trace requests completed on mmcn, see memlog_hosts */
+extern unsigned long memlog_host_mask;
+
+static inline int memlog_host_traced(int index)
+{
+	return index < BITS_PER_LONG &&
+		(ACCESS_ONCE(memlog_host_mask) & (1UL << index));
+}
 
 int init_memLog(void);
-int memlog_emmc_add(struct mmc_request *mrq, unsigned long long curTime, unsigned long long latency);
+int memlog_emmc_add(struct mmc_request *mrq);
+int memlog_emmc_defer(struct mmc_request *mrq, const u32 *packed_hdr,
+		      int nr_words);
 #if defined(CONFIG_FMBT_TRACE_EMMC)
-int memlog_packed_add(u32 packed_cmd_hdr, u8 hdr);
+int memlog_packed_add(int host, u32 packed_cmd_hdr, u8 hdr);
 #endif
-int memlog_opcode_add(struct mmc_request *mrq, unsigned long long curTime, unsigned long long latency);
+int memlog_opcode_add(struct mmc_request *mrq);
 int memlog_app_add(int start, int name);
 int memlog_set_enable(int enable);
-int memlog_print(void);
+#if defined(CONFIG_FMBT_TRACE_EMMC)
+int memlog_block_add(int host, u8 event, u32 sector, u32 blocks,
+		     u8 app_num, u8 arg);
+#else
+static inline int memlog_block_add(int host, u8 event, u32 sector,
+				   u32 blocks, u8 app_num, u8 arg)
+{
+	return 0;
+}
+#endif
 int memlog_release(void);
+int memlog_destroy(void);
 
 //#define CONFIG_MMC_MEM_LOG_DEBUG
 
@@ -81,6 +81,13 @@
   /* class 7 */
 #define MMC_LOCK_UNLOCK          42   /* adtc                    R1b */
 
+  /* class 11 */
+#define MMC_QUE_TASK_PARAMS      44   /* ac   [31:0] See below   R1  */
+#define MMC_QUE_TASK_ADDR        45   /* ac   [31:0] data addr   R1  */
+#define MMC_EXECUTE_READ_TASK    46   /* adtc [20:16] task id    R1  */
+#define MMC_EXECUTE_WRITE_TASK   47   /* adtc [20:16] task id    R1  */
+#define MMC_CMDQ_TASK_MGMT       48   /* ac   [20:16] task id    R1b */
+
   /* class 8 */
 #define MMC_APP_CMD              55   /* ac   [31:16] RCA        R1  */
 #define MMC_GEN_CMD              56   /* adtc [0] RD/WR          R1  */
@@ -92,6 +99,32 @@ static inline bool mmc_op_multi(u32 opcode)
 	       opcode == MMC_READ_MULTIPLE_BLOCK;
 }
 
+/*
+ * MMC_QUE_TASK_PARAMS argument format:
+ *
+ *	[31]	Reliable write
+ *	[30]	Data direction, 1 is read
+ *	[29]	Tag request
+ *	[28:25]	Context ID
+ *	[24]	Forced programming
+ *	[23]	Priority
+ *	[20:16]	Task ID
+ *	[15:0]	Number of blocks
+ */
+#define MMC_CMDQ_REL_WR		(1 << 31)
+#define MMC_CMDQ_READ		(1 << 30)
+#define MMC_CMDQ_FORCED_PRG	(1 << 24)
+#define MMC_CMDQ_PRIO_HIGH	(1 << 23)
+#define MMC_CMDQ_TASK_ID(x)	(((x) & 0x1f) << 16)
+#define MMC_CMDQ_MAX_BLOCKS	0xffff
+
+/* MMC_CMDQ_TASK_MGMT op codes, task id goes in [20:16] */
+#define MMC_CMDQ_DISCARD_QUEUE	0x1
+#define MMC_CMDQ_DISCARD_TASK	0x2
+
+/* MMC_SEND_STATUS with this bit returns the queue status register */
+#define MMC_SEND_STATUS_SQS	(1 << 15)
+
 /*
  * MMC_SWITCH argument format:
  *
@@ -144,6 +177,16 @@ static inline bool mmc_op_multi(u32 opcode)
 #define R1_EXCEPTION_EVENT	(1 << 6)	/* sx, a */
 #define R1_APP_CMD		(1 << 5)	/* sr, c */
 
+/*
+ * R1 bits that fail a command queue operation.  Legacy data commands
+ * are illegal while CMDQ_MODE_EN is set, so R1_ILLEGAL_COMMAND there
+ * usually means the queue and the card disagree about the mode.
+ */
+#define R1_CMDQ_ERRORS	(R1_OUT_OF_RANGE | R1_ADDRESS_ERROR | \
+			 R1_WP_VIOLATION | R1_COM_CRC_ERROR | \
+			 R1_ILLEGAL_COMMAND | R1_CARD_ECC_FAILED | \
+			 R1_CC_ERROR | R1_ERROR)
+
 #define R1_STATE_IDLE	0
 #define R1_STATE_READY	1
 #define R1_STATE_IDENT	2
@@ -275,6 +318,7 @@ struct _mmc_csd {
  * EXT_CSD fields
  */
 
+#define EXT_CSD_CMDQ_MODE_EN		15	/* R/W */
 #define EXT_CSD_FLUSH_CACHE		32      /* W */
 #define EXT_CSD_CACHE_CTRL		33      /* R/W */
 #define EXT_CSD_POWER_OFF_NOTIFICATION	34	/* R/W */
@@ -331,6 +375,11 @@ struct _mmc_csd {
 #define EXT_CSD_CACHE_SIZE		249	/* RO, 4 bytes */
 #define EXT_CSD_PWR_CL_DDR_200_195	253	/* RO */
 #define EXT_CSD_PWR_CL_DDR_200_360	254	/* RO */
+#define EXT_CSD_PRE_EOL_INFO		267	/* RO */
+#define EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A	268	/* RO */
+#define EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B	269	/* RO */
+#define EXT_CSD_CMDQ_DEPTH		307	/* RO */
+#define EXT_CSD_CMDQ_SUPPORT		308	/* RO */
 #define EXT_CSD_TAG_UNIT_SIZE		498	/* RO */
 #define EXT_CSD_DATA_TAG_SUPPORT	499	/* RO */
 #define EXT_CSD_MAX_PACKED_WRITES	500	/* RO */
@@ -0,0 +1,280 @@
+#!/usr/bin/env python
+# Decoder and analysis tool for /dev/memlog captures
+#
+# A capture is what read() on /dev/memlog returns: a struct
+# memlog_stream_hdr followed by mem_log_rec_t records, see
+# include/mmc/mem_log.h.  Either read the device directly or a file
+# saved with e.g. "cat /dev/memlog > trace.bin".
+#
+#   memlog_decode.py trace.bin                   summary on stdout
+#   memlog_decode.py trace.bin --csv recs.csv    one line per request
+#   memlog_decode.py trace.bin --json sum.json   summary as JSON
+#   memlog_decode.py trace.bin --bin-ms 100      throughput/depth bins
+
+from __future__ import print_function
+
+import argparse
+import csv
+import json
+import struct
+import sys
+
+MEMLOG_MAGIC = 0x474c4d4d
+
+# targets, include/mmc/mem_log.h
+MEM_LOG_MMC = 0x01
+MEM_LOG_BLOCK = 0x03
+MEM_LOG_APP = 0x04
+MEM_LOG_SYNC = 0x05
+
+# mmc commands
+MEM_LOG_READ = 0x01
+MEM_LOG_WRITE = 0x02
+MEM_LOG_OPCODE = 0x03
+MEM_LOG_PACKED = 0x04
+
+APP_NAMES = ['CAMERA', 'WEB_S_ON', 'WEB_S_OFF', 'WEB_L_OFF', 'CONTACTS',
+             'PACKAGE', 'YOUTUBE', 'MANUAL']
+
+BLK_EVENTS = {1: 'FETCH', 2: 'PACK', 3: 'REINSERT', 4: 'BKOPS_START',
+              5: 'BKOPS_STOP', 6: 'CLK_SCALE'}
+
+STREAM_HDR = struct.Struct('<IHHHBBI')
+# version 1 records had no queue time
+RECORD_FMT = {20: '<IIIHBBBBBB', 24: '<IIIHBBBBBBI'}
+
+
+class Request(object):
+    __slots__ = ('done', 'latency', 'queue', 'sector', 'blocks', 'opcode',
+                 'dir', 'host', 'error', 'app', 'packed')
+
+    def issue(self):
+        return self.done - self.latency - self.queue
+
+
+def read_capture(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if len(data) < STREAM_HDR.size:
+        raise ValueError('%s: too short for a stream header' % path)
+    magic, version, hdr_size, rec_size, clock, _, sync = \
+        STREAM_HDR.unpack_from(data, 0)
+    if magic != MEMLOG_MAGIC:
+        raise ValueError('%s: bad magic 0x%08x' % (path, magic))
+    if rec_size not in RECORD_FMT:
+        raise ValueError('%s: unknown record size %d' % (path, rec_size))
+    hdr = {'version': version, 'record_size': rec_size, 'clock': clock,
+           'sync_interval': sync}
+    body = data[hdr_size:]
+    body = body[:len(body) - len(body) % rec_size]
+    return hdr, struct.Struct(RECORD_FMT[rec_size]), body
+
+
+def iter_records(rec, body):
+    if hasattr(rec, 'iter_unpack'):
+        return rec.iter_unpack(body)
+    return (rec.unpack_from(body, off)
+            for off in range(0, len(body), rec.size))
+
+
+def decode(hdr, rec, body):
+    """Returns (requests, app spans, block events)."""
+    requests = []
+    events = []
+    spans = []
+    open_apps = {}
+    epoch = None
+    last = None
+
+    for r in iter_records(rec, body):
+        ts_delta, latency, sector, blocks, opcode, flag, host, app_num, \
+            error, arg = r[:10]
+        queue = r[10] if len(r) > 10 else 0
+        target = flag & 0x07
+        cmd = (flag >> 3) & 0x07
+
+        if target == MEM_LOG_SYNC:
+            epoch = (sector << 32) | ts_delta
+            continue
+        if epoch is None:
+            # lost the SYNC this record is relative to
+            continue
+        t = epoch + ts_delta
+
+        if target == MEM_LOG_MMC:
+            if cmd == MEM_LOG_PACKED:
+                # header word, then CMD23 arg and CMD18/25 arg per request
+                if last is not None and last.opcode in (18, 25):
+                    if opcode == 0:
+                        last.packed = []
+                    elif last.packed is not None:
+                        if opcode == 1:
+                            last.packed.append([0, sector & 0xffff])
+                        elif opcode == 2 and last.packed:
+                            last.packed[-1][0] = sector
+                continue
+            q = Request()
+            q.done = t
+            q.latency = latency
+            q.queue = queue
+            q.sector = sector
+            q.blocks = blocks
+            q.opcode = opcode
+            q.dir = {MEM_LOG_READ: 'read', MEM_LOG_WRITE: 'write'}.get(
+                cmd, 'cmd')
+            q.host = host
+            q.error = error
+            q.app = ','.join(sorted(open_apps)) or 'none'
+            q.packed = None
+            requests.append(q)
+            last = q
+        elif target == MEM_LOG_APP:
+            name = APP_NAMES[app_num] if app_num < len(APP_NAMES) \
+                else str(app_num)
+            if (flag >> 6) & 0x01:
+                open_apps[name] = t
+            elif name in open_apps:
+                spans.append((name, open_apps.pop(name), t))
+        elif target == MEM_LOG_BLOCK:
+            events.append((t, host, BLK_EVENTS.get(opcode, str(opcode)),
+                           sector, blocks, app_num, arg))
+
+    for name, start in open_apps.items():
+        spans.append((name, start, None))
+    return requests, spans, events
+
+
+def percentile(sorted_vals, pct):
+    if not sorted_vals:
+        return 0
+    idx = int(len(sorted_vals) * pct / 100.0 + 0.999999) - 1
+    return sorted_vals[max(0, min(idx, len(sorted_vals) - 1))]
+
+
+def latency_stats(requests):
+    """Per app marker and direction latency distribution, in us."""
+    groups = {}
+    for q in requests:
+        if q.dir == 'cmd':
+            continue
+        groups.setdefault((q.app, q.dir), []).append(q.latency)
+    out = []
+    for (app, d), lat in sorted(groups.items()):
+        lat.sort()
+        out.append({
+            'app': app, 'dir': d, 'count': len(lat),
+            'mean_us': float(sum(lat)) / len(lat) / 1000.0,
+            'p50_us': percentile(lat, 50) / 1000.0,
+            'p99_us': percentile(lat, 99) / 1000.0,
+            'p99.9_us': percentile(lat, 99.9) / 1000.0,
+            'max_us': lat[-1] / 1000.0,
+        })
+    return out
+
+
+def time_bins(requests, bin_ns):
+    """Throughput and queue depth per time bin."""
+    if not requests:
+        return []
+    start = min(q.issue() for q in requests)
+    end = max(q.done for q in requests)
+    nbins = int((end - start) // bin_ns) + 1
+    rd = [0] * nbins
+    wr = [0] * nbins
+    area = [0] * nbins
+    peak = [0] * nbins
+
+    # queue depth: +1 at issue, -1 at done, integrated over each bin
+    edges = []
+    for q in requests:
+        if q.dir == 'read':
+            rd[int((q.done - start) // bin_ns)] += q.blocks * 512
+        elif q.dir == 'write':
+            wr[int((q.done - start) // bin_ns)] += q.blocks * 512
+        edges.append((q.issue(), 1))
+        edges.append((q.done, -1))
+    edges.sort()
+
+    depth = 0
+    prev = start
+    for t, step in edges:
+        while prev < t:
+            b = int((prev - start) // bin_ns)
+            upto = min(t, start + (b + 1) * bin_ns)
+            area[b] += depth * (upto - prev)
+            prev = upto
+        depth += step
+        b = min(int((t - start) // bin_ns), nbins - 1)
+        peak[b] = max(peak[b], depth)
+
+    sec = bin_ns / 1e9
+    return [{
+        'start_ms': (i * bin_ns) / 1e6,
+        'read_MBps': rd[i] / sec / 1e6,
+        'write_MBps': wr[i] / sec / 1e6,
+        'avg_depth': area[i] / float(bin_ns),
+        'max_depth': peak[i],
+    } for i in range(nbins)]
+
+
+def write_csv(path, requests):
+    with open(path, 'w') as f:
+        w = csv.writer(f)
+        w.writerow(['done_ns', 'host', 'dir', 'opcode', 'sector', 'blocks',
+                    'latency_ns', 'queue_ns', 'error', 'app', 'packed'])
+        for q in requests:
+            packed = ' '.join('%d+%d' % (s, n) for s, n in q.packed) \
+                if q.packed else ''
+            w.writerow([q.done, q.host, q.dir, q.opcode, q.sector, q.blocks,
+                        q.latency, q.queue, q.error, q.app, packed])
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Decode /dev/memlog captures')
+    ap.add_argument('capture', help='/dev/memlog or a saved capture')
+    ap.add_argument('--csv', help='write one line per request')
+    ap.add_argument('--json', help='write the summary as JSON')
+    ap.add_argument('--bin-ms', type=float, default=1000.0,
+                    help='throughput/queue depth bin size (default 1000)')
+    args = ap.parse_args()
+
+    hdr, rec, body = read_capture(args.capture)
+    requests, spans, events = decode(hdr, rec, body)
+
+    packed = [q for q in requests if q.packed]
+    summary = {
+        'header': hdr,
+        'requests': len(requests),
+        'packed_groups': len(packed),
+        'packed_requests': sum(len(q.packed) for q in packed),
+        'errors': sum(1 for q in requests if q.error),
+        'block_events': dict((n, sum(1 for e in events if e[2] == n))
+                             for n in set(e[2] for e in events)),
+        'apps': [{'app': n, 'start_ns': s, 'end_ns': e}
+                 for n, s, e in spans],
+        'latency': latency_stats(requests),
+        'bins': time_bins(requests, int(args.bin_ms * 1e6)),
+    }
+
+    if args.csv:
+        write_csv(args.csv, requests)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(summary, f, indent=1)
+
+    print('version %d, %d requests, %d packed groups (%d requests), '
+          '%d errors' % (hdr['version'], summary['requests'],
+                         summary['packed_groups'],
+                         summary['packed_requests'], summary['errors']))
+    print('%-20s %-5s %8s %10s %10s %10s %10s' %
+          ('app', 'dir', 'count', 'p50(us)', 'p99(us)', 'p99.9(us)',
+           'max(us)'))
+    for l in summary['latency']:
+        print('%-20s %-5s %8d %10.1f %10.1f %10.1f %10.1f' %
+              (l['app'], l['dir'], l['count'], l['p50_us'], l['p99_us'],
+               l['p99.9_us'], l['max_us']))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())